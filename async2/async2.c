@@ -19,11 +19,175 @@ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
  */
+#define ASYNC2_C_
 #include "async2.h"
 #include <stdarg.h> /* va_start, va_end, va_arg, va_list */
 #include <stdlib.h> /* ma|re|calloc, free */
 #include <string.h> /* memset, memmove */
-#include <time.h> /* clock_t, CLOCKS_PER_SEC */
+#include <time.h> /* clock, CLOCKS_PER_SEC, clock_gettime, nanosleep */
+#include <limits.h> /* ULONG_MAX */
+#include <stdio.h> /* fopen, fread, fwrite, getc, putc */
+
+/* Structure-of-arrays loop revisits all waiting tasks this often to pick up changes made by other tasks */
+#ifndef ASYNC_SOA_SWEEP_TICKS
+    #define ASYNC_SOA_SWEEP_TICKS 64
+#endif
+
+/*
+ * Task arena is carved into slabs of this many bytes, each serving states of one size class.
+ * Default matches x86-64 huge page size, so a slab is backed by a single TLB entry.
+ */
+#ifndef ASYNC_ARENA_SLAB
+    #define ASYNC_ARENA_SLAB (2 * 1024 * 1024UL)
+#endif
+
+/* States bigger than this are never allocated from the arena */
+#ifndef ASYNC_ARENA_MAX_STATE
+    #define ASYNC_ARENA_MAX_STATE 4096
+#endif
+
+/* Number of empty slabs kept committed for reuse before pages are returned to the OS */
+#ifndef ASYNC_ARENA_KEEP_SLABS
+    #define ASYNC_ARENA_KEEP_SLABS 4
+#endif
+
+#if defined(__GNUC__)
+    #define ASYNC_INLINE __inline__
+#elif defined(_MSC_VER)
+    #define ASYNC_INLINE __inline
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 199901L
+    #define ASYNC_INLINE inline
+#else
+    #define ASYNC_INLINE
+#endif
+
+/* Number of multi-level feedback queue levels, level n is resumed once in 2^n loop cycles */
+#ifndef ASYNC_MLFQ_LEVELS
+    #define ASYNC_MLFQ_LEVELS 4
+#endif
+
+/* Consecutive resumes without progress after which multi-level feedback queue demotes a task */
+#ifndef ASYNC_MLFQ_DEMOTE_AFTER
+    #define ASYNC_MLFQ_DEMOTE_AFTER 4
+#endif
+
+/*
+ * Extra resumes per cycle earliest deadline first loop gives tasks with deadline that stay runnable,
+ * before it moves on to later deadlines and tasks without one
+ */
+#ifndef ASYNC_EDF_BUDGET
+    #define ASYNC_EDF_BUDGET 1024
+#endif
+
+/* Samples the profiler keeps between dumps and frames recorded per sample, innermost first */
+#ifndef ASYNC_PROFILE_SAMPLES
+    #define ASYNC_PROFILE_SAMPLES 16384
+#endif
+
+#ifndef ASYNC_PROFILE_DEPTH
+    #define ASYNC_PROFILE_DEPTH 8
+#endif
+
+/* Virtual seconds every simulation loop cycle costs, so tasks polling async_now() still see time pass */
+#ifndef ASYNC_SIM_CYCLE
+    #define ASYNC_SIM_CYCLE 1e-6
+#endif
+
+/* Chunks async_file_chunks asks the kernel to read ahead of the current one */
+#ifndef ASYNC_CHUNKS_AHEAD
+    #define ASYNC_CHUNKS_AHEAD 4
+#endif
+
+/* Polls 0.1 ms apart await_chunk waits for chunk pages to arrive before touching them anyway */
+#ifndef ASYNC_CHUNKS_POLLS
+    #define ASYNC_CHUNKS_POLLS 100
+#endif
+
+/* Interval of inotify reads while the loop is busy, idle loops wait on the descriptor instead */
+#ifndef ASYNC_WATCH_POLL
+    #define ASYNC_WATCH_POLL 1e-3
+#endif
+
+/* Timer waiting watches park on, so loops with nothing else to do sleep in poll for that long */
+#ifndef ASYNC_WATCH_PARK
+    #define ASYNC_WATCH_PARK 3600
+#endif
+
+/* Interval write-ahead log writer checks its flusher thread at, sleeping in between leaves the CPU to it */
+#ifndef ASYNC_WAL_POLL
+    #define ASYNC_WAL_POLL 1e-4
+#endif
+
+/* Records the async_log ring holds and bytes of each, longer messages are truncated */
+#ifndef ASYNC_LOG_SLOTS
+    #define ASYNC_LOG_SLOTS 1024
+#endif
+
+#ifndef ASYNC_LOG_LINE
+    #define ASYNC_LOG_LINE 128
+#endif
+
+/* Define ASYNC_NO_SIMD to force scalar scans */
+#if defined(ASYNC_NO_SIMD)
+#elif defined(__AVX2__)
+    #include <immintrin.h> /* _mm256_cmpeq_epi8, _mm256_movemask_epi8 */
+    #define ASYNC_SIMD_AVX2_
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h> /* _mm_cmpeq_epi8, _mm_movemask_epi8 */
+    #define ASYNC_SIMD_SSE2_
+#endif
+
+#if defined(_MSC_VER)
+    #include <intrin.h> /* _BitScanForward */
+#endif
+
+#if defined(_WIN32)
+    #define WIN32_LEAN_AND_MEAN
+    #include <windows.h> /* QueryPerformanceCounter, Sleep */
+    #define ASYNC_OS_WIN32_
+#elif (defined(__unix__) || defined(__APPLE__)) && defined(CLOCK_MONOTONIC)
+    #include <errno.h> /* errno, EINTR */
+    #include <sys/mman.h> /* mmap, munmap, madvise */
+    #define ASYNC_OS_POSIX_
+    #if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+        #define MAP_ANONYMOUS MAP_ANON
+    #endif
+    #if defined(MAP_ANONYMOUS) && defined(MADV_DONTNEED)
+        #define ASYNC_ARENA_
+    #endif
+    #include <fcntl.h> /* open, O_CREAT */
+    #include <unistd.h> /* ftruncate, write, fdatasync, close */
+    #include <pthread.h> /* pthread_create, pthread_cond_wait, pthread_sigmask */
+    #include <signal.h> /* sigfillset */
+    #define ASYNC_WAL_
+    #if defined(__APPLE__)
+        #define fdatasync fsync
+    #endif
+    #if defined(MAP_SHARED)
+        #define ASYNC_METRICS_
+    #endif
+    #include <sys/uio.h> /* writev, struct iovec */
+    #define ASYNC_LOG_
+    #if !defined(IOV_MAX)
+        #define IOV_MAX 16
+    #endif
+    #if defined(__linux__)
+        #include <poll.h> /* poll, POLLIN */
+        #include <sys/inotify.h> /* inotify_init1, inotify_add_watch */
+        #define ASYNC_WATCH_
+    #endif
+    #if defined(MAP_PRIVATE) && defined(MADV_WILLNEED) && defined(MADV_DONTNEED)
+        #include <sys/stat.h> /* fstat */
+        #define ASYNC_CHUNKS_
+    #endif
+    #if defined(ASYNC_PROFILE)
+        #include <signal.h> /* sigaction, sigprocmask, SIGPROF */
+        #include <sys/time.h> /* setitimer, ITIMER_PROF */
+        #if defined(SIGPROF) && defined(ITIMER_PROF)
+            #define ASYNC_PROFILE_
+        #endif
+    #endif
+#endif
 
 /*
  * event loop member functions declaration
@@ -40,6 +204,139 @@ static void async_loop_run_until_complete_(struct astate *main);
 
 static void async_loop_destroy_(void);
 
+static void async_loop_wait_(double wakeup);
+
+/* Every loop resumes tasks through async_resume_, so the profilers know which one is running and when it finishes */
+#ifdef ASYNC_PROFILE
+static struct astate *volatile async_running_ = NULL;
+
+static int async_critpath_on_ = 0;
+
+static void async_critpath_spawned_(struct astate *state);
+
+static void async_critpath_done_(struct astate *state);
+
+/*
+ * Frames of the awaiting parents of owner, innermost first, recorded before owner is resumed while the sampling
+ * profiler runs. The SIGPROF handler copies them instead of following _parent, which may be freed under it.
+ * owner is cleared while the frames are rewritten, so the handler never copies frames of another state.
+ */
+static struct {
+    const char *volatile names[ASYNC_PROFILE_DEPTH];
+    volatile unsigned int lines[ASYNC_PROFILE_DEPTH];
+    volatile unsigned int depth;
+    struct astate *volatile owner;
+    volatile int on;
+} async_profile_chain_;
+
+static void async_profile_chain_set_(struct astate *state) {
+    struct astate *parent = state->_parent;
+    unsigned int depth = 0;
+    async_profile_chain_.owner = NULL;
+    for (; parent != NULL && depth < ASYNC_PROFILE_DEPTH - 1; parent = parent->_parent, depth++) {
+        async_profile_chain_.names[depth] = parent->_funcname ? parent->_funcname : "?";
+        async_profile_chain_.lines[depth] = parent->_async_k;
+    }
+    async_profile_chain_.depth = depth;
+    async_profile_chain_.owner = state;
+}
+
+static ASYNC_INLINE async async_resume_(struct astate *state) {
+    struct astate *outer = async_running_; /* loops can be run from inside a coroutine */
+    async status;
+    if (async_critpath_on_ && state->_span_id == 0) {
+        async_critpath_spawned_(state); /* main task of run_until_complete is resumed without being scheduled */
+    }
+    if (async_profile_chain_.on) {
+        async_profile_chain_set_(state);
+    }
+    async_running_ = state;
+    status = state->_func(state);
+    async_running_ = outer;
+    if (async_profile_chain_.on && outer != NULL) {
+        async_profile_chain_set_(outer);
+    }
+    if (async_critpath_on_ && status == ASYNC_DONE) {
+        async_critpath_done_(state);
+    }
+    return status;
+}
+#else
+    #define async_resume_(state) ((state)->_func(state))
+#endif
+
+/* Metrics file of async_metrics_open, loops publish into it after every cycle */
+static struct async_metrics *async_metrics_ = NULL;
+
+/* Process clock at the start of the current cycle, the loop's own clock may be virtual */
+static double async_metrics_started_;
+
+static void async_metrics_publish_(void);
+
+/* Timers of parked tasks the current cycle's pass came across, and timers that woke a task since the file was opened */
+static unsigned long async_metrics_armed_, async_metrics_expiries_;
+
+#define async_metrics_begin_() \
+    if (async_metrics_ != NULL) async_metrics_started_ = async_os_clock_(), async_metrics_armed_ = 0
+
+/* Clear the timer of a state about to be resumed, it expired unless a finished child woke the state first */
+#define async_disarm_(state)                                                                                    \
+    {                                                                                                           \
+        if ((state)->_wakeup != 0 && ((state)->_next == NULL || !async_done((state)->_next))) {                 \
+            async_metrics_expiries_++;                                                                          \
+        }                                                                                                       \
+        (state)->_wakeup = 0;                                                                                   \
+    } (void) 0
+
+#define async_metrics_cycle_() if (async_metrics_ != NULL) async_metrics_publish_()
+
+/* Inotify descriptor of all path watches, loops read it after a cycle at most once per ASYNC_WATCH_POLL and poll it while idle */
+#ifdef ASYNC_WATCH_
+static int async_inotify_fd_ = -1;
+
+static double async_watch_next_poll_ = 0;
+
+static void async_watch_dispatch_(void);
+
+static int async_watch_poll_(double sec);
+
+#define async_watch_cycle_() if (async_inotify_fd_ >= 0 && event_loop->now >= async_watch_next_poll_) async_watch_dispatch_()
+#else
+#define async_watch_cycle_() (void) 0
+#define async_watch_poll_(sec) 0
+#endif
+
+/* Number of states allocated and not freed yet */
+static size_t async_n_states_ = 0;
+
+/* Names states awaiting children they schedule before being resumed themselves */
+#if defined(ASYNC_PROFILE) || defined(ASYNC_WATCHDOG)
+    #define async_set_funcname_(state, name) ((state)->_funcname = (name))
+#else
+    #define async_set_funcname_(state, name) (void) 0
+#endif
+
+/* Watchdog tracks every allocated state, so states that were never scheduled can be found too */
+#ifdef ASYNC_WATCHDOG
+static struct astate *async_live_ = NULL;
+
+static void async_live_link_(struct astate *state) {
+    state->_since = async_now();
+    state->_live_next = async_live_;
+    if (async_live_ != NULL) async_live_->_live_prev = state;
+    async_live_ = state;
+}
+
+static void async_live_unlink_(struct astate *state) {
+    if (state->_live_prev != NULL) state->_live_prev->_live_next = state->_live_next;
+    else async_live_ = state->_live_next;
+    if (state->_live_next != NULL) state->_live_next->_live_prev = state->_live_prev;
+}
+#else
+    #define async_live_link_(state) (void) 0
+    #define async_live_unlink_(state) (void) 0
+#endif
+
 /* array is inspired by rxi's vec: https://github.com/rxi/vec */
 static int async_arr_expand_(char **data, const size_t *len, size_t *capacity, size_t memsz, size_t n_memb) {
     void *mem;
@@ -106,6 +403,64 @@ static int async_all_(size_t n, struct astate **states) { /* Returns false if at
     return 1;
 }
 
+/* Monotonic clock in seconds from unspecified origin, falls back to processor time where there's no such clock */
+static double async_os_clock_(void) {
+#if defined(ASYNC_OS_WIN32_)
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER counter;
+    if (freq.QuadPart == 0) {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&counter);
+    return (double) counter.QuadPart / (double) freq.QuadPart;
+#elif defined(ASYNC_OS_POSIX_)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+#else
+    return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/* Returns 0 if there's no portable way to block on this platform, so the loop has to keep polling */
+static int async_os_sleep_(double sec) {
+#if defined(ASYNC_OS_WIN32_)
+    Sleep((DWORD) (sec * 1000) + 1);
+    return 1;
+#elif defined(ASYNC_OS_POSIX_)
+    struct timespec ts;
+    ts.tv_sec = (time_t) sec;
+    ts.tv_nsec = (long) ((sec - (double) ts.tv_sec) * 1e9) + 1; /* round up, so the timer is due after waking */
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {}
+    return 1;
+#else
+    (void) sec;
+    return 0;
+#endif
+}
+
+/* Round deadline up to the nearest multiple of slack, so timers expiring in the same window fire together */
+static double async_timer_align_(double deadline, double slack) {
+    double n;
+    if (slack <= 0) return deadline;
+    n = deadline / slack;
+    if (n >= (double) ULONG_MAX) return deadline;
+    n = (double) (unsigned long) n;
+    if (n * slack < deadline) n += 1;
+    return n * slack;
+}
+
+/* Arm state's timer and return 1 if deadline is still in the future, return 0 otherwise */
+static int async_park_(struct astate *state, double deadline) {
+    if (async_now() >= deadline) return 0;
+    state->_wakeup = deadline;
+    return 1;
+}
+
 /* Init default event loop, custom event loop should create own initializer instead. */
 static struct async_event_loop async_standard_event_loop_ = {
         async_loop_init_,
@@ -114,234 +469,1945 @@ static struct async_event_loop async_standard_event_loop_ = {
         async_loop_add_tasks_,
         async_loop_run_forever_,
         async_loop_run_until_complete_,
-        {0, 0, 0},
-        {0, 0, 0}, /* fill array structs with zeros */
+        NULL,
+        NULL, /* empty tasks list */
+        0,
+        0,
+        0,
+        0, 0, /* no admission limits by default */
+        0, 0,
+        0,
+        0,
+        0, /* late tasks are resumed last */
+        NULL /* every task is looked at on every cycle, no need to be woken */
 };
 
 struct async_event_loop *async_default_event_loop = &async_standard_event_loop_;
 
 static struct async_event_loop *event_loop = &async_standard_event_loop_;
 
+void async_wake_(struct astate *state) {
+    if (event_loop->wake != NULL) event_loop->wake(state);
+}
+
+/* Resumes during the current cycle that only found the loop without capacity, see await_capacity */
+static size_t async_capacity_waits_ = 0;
 
-/* Free astate, its allocs and invalidate it completely */
-#define STATE_FREE(state)                                         \
+/* Tasks waiting in await_capacity are resumed every cycle, but don't count as runnable, or they'd never get any */
+#define async_set_runnable_(loop, runnable)                                                                  \
+    {                                                                                                        \
+        (loop)->n_runnable = (runnable) > async_capacity_waits_ ? (runnable) - async_capacity_waits_ : 0;   \
+        async_capacity_waits_ = 0;                                                                           \
+    } (void) 0
+
+
+/*
+ * Header of the memory block shared by states created with async_new_many,
+ * every member state is preceded by a pointer to it
+ */
+struct async_block {
+    size_t live; /* number of member states not freed yet */
+};
+
+#define async_block_of_(state) (*(struct async_block **) ((char *) (state) - sizeof(struct async_block *)))
+
+#ifdef ASYNC_NO_ALLOCS
+    #define async_state_free_allocs_(state) (void) 0
+#else
+    #define async_state_free_allocs_(state)                           \
+        {                                                             \
+            while ((state)->_allocs.length--) {                       \
+                free((state)->_allocs.data[(state)->_allocs.length]); \
+            }                                                         \
+            async_arr_destroy(&(state)->_allocs);                     \
+        } (void) 0
+#endif
+
+/* Free astate, its allocs and invalidate it completely, memory of the state itself is given to release */
+#define STATE_FREE_WITH_(state, release)                          \
     {                                                             \
-        while ((state)->_allocs.length--) {                       \
-            free((state)->_allocs.data[(state)->_allocs.length]); \
+        async_n_states_--;                                        \
+        async_live_unlink_(state);                                \
+        async_state_free_allocs_(state);                          \
+        if ((state)->_flags & _ASYNC_FLAG_BLOCK) {                \
+            async_block_release_(state);                          \
+        } else {                                                  \
+            (release)(state);                                     \
         }                                                         \
-        async_arr_destroy(&(state)->_allocs);                     \
-        free(state);                                              \
     } (void) 0
 
+/* Free astate, its allocs and invalidate it completely */
+#define STATE_FREE(state) STATE_FREE_WITH_(state, async_state_release_)
 
-#define ASYNC_LOOP_HEAD   \
-    size_t i;             \
-    struct astate *state  \
+#define async_align_up_(n, align) (((n) + (align) - 1) / (align) * (align))
 
-#define ASYNC_LOOP_RUNNER_BLOCK_NOREFS                         \
-    if (state->_refcnt == 0) {                                \
-        if (!async_done(state) && state->_cancel != NULL) {    \
-            state->_cancel(state);                             \
-        }                                                      \
-        STATE_FREE(state);                                     \
-        if (async_arr_push(&event_loop->vacant_queue, i)) {    \
-            event_loop->events_queue.data[i] = NULL;           \
-        } else {                                               \
-            async_arr_splice(&event_loop->events_queue, i, 1); \
-            i--;                                               \
-        }                                                      \
+#define ASYNC_ARENA_ALIGN 16
+
+#define ASYNC_ARENA_CLASSES (ASYNC_ARENA_MAX_STATE / ASYNC_ARENA_ALIGN)
+
+/* Slab descriptors live outside of the arena, so empty slabs can be released to the OS entirely */
+struct async_slab {
+    struct async_slab *prev, *next; /* partial list of the size class or empty list */
+    char *bump; /* never used memory of the slab starts here */
+    void *free_list; /* freed states, each one stores the next */
+    size_t size; /* state size in bytes, 0 if slab is empty */
+    size_t live; /* number of states allocated from the slab */
+};
+
+static struct {
+    char *base;
+    size_t size, carved; /* bytes reserved and bytes already split into slabs */
+    struct async_slab *slabs;
+    struct async_slab *partial[ASYNC_ARENA_CLASSES]; /* slabs with room for one more state per class */
+    struct async_slab *empty, *released; /* empty slabs still committed and the ones returned to the OS */
+    size_t n_empty, n_released;
+    size_t live; /* number of states allocated from the arena */
+} async_arena_;
+
+#define async_in_arena_(state) \
+    ((char *) (state) >= async_arena_.base && (char *) (state) < async_arena_.base + async_arena_.size)
+
+#define async_slab_base_(slab) (async_arena_.base + (size_t) ((slab) - async_arena_.slabs) * ASYNC_ARENA_SLAB)
+
+#define async_slab_full_(slab) \
+    ((slab)->free_list == NULL && (size_t) ((slab)->bump - async_slab_base_(slab)) + (slab)->size > ASYNC_ARENA_SLAB)
+
+#define async_slab_push_(list, slab)                \
+    {                                               \
+        (slab)->prev = NULL;                        \
+        (slab)->next = (list);                      \
+        if ((list) != NULL) (list)->prev = (slab);  \
+        (list) = (slab);                            \
+    } (void) 0
+
+#define async_slab_pop_(list, slab)                                   \
+    {                                                                 \
+        if ((slab)->prev != NULL) {                                   \
+            (slab)->prev->next = (slab)->next;                        \
+        } else {                                                      \
+            (list) = (slab)->next;                                    \
+        }                                                             \
+        if ((slab)->next != NULL) (slab)->next->prev = (slab)->prev;  \
+    } (void) 0
+
+/* Give pages of an empty slab back to the OS, they read as zeros when touched again */
+static size_t async_slab_release_(struct async_slab *slab) {
+#ifdef ASYNC_ARENA_
+    async_slab_pop_(async_arena_.empty, slab);
+    async_arena_.n_empty--;
+    madvise(async_slab_base_(slab), ASYNC_ARENA_SLAB, MADV_DONTNEED);
+    async_slab_push_(async_arena_.released, slab);
+    async_arena_.n_released++;
+    return ASYNC_ARENA_SLAB;
+#else
+    (void) slab;
+    return 0;
+#endif
+}
+
+/* Returns zeroed memory for a state of size bytes from the arena, NULL if it can't be served */
+static void *async_arena_alloc_(size_t size) {
+    struct async_slab *slab;
+    size_t cls;
+    char *mem;
+
+    if (async_arena_.base == NULL || size > ASYNC_ARENA_MAX_STATE) return NULL;
+    size = async_align_up_(size, ASYNC_ARENA_ALIGN);
+    cls = size / ASYNC_ARENA_ALIGN - 1;
+    slab = async_arena_.partial[cls];
+    if (slab == NULL) {
+        if (async_arena_.empty != NULL) {
+            slab = async_arena_.empty;
+            async_slab_pop_(async_arena_.empty, slab);
+            async_arena_.n_empty--;
+        } else if (async_arena_.released != NULL) {
+            slab = async_arena_.released;
+            async_slab_pop_(async_arena_.released, slab);
+            async_arena_.n_released--;
+        } else if (async_arena_.carved < async_arena_.size) {
+            slab = &async_arena_.slabs[async_arena_.carved / ASYNC_ARENA_SLAB];
+            async_arena_.carved += ASYNC_ARENA_SLAB;
+        } else {
+            return NULL;
+        }
+        slab->bump = async_slab_base_(slab);
+        slab->free_list = NULL;
+        slab->size = size;
+        async_slab_push_(async_arena_.partial[cls], slab);
+    }
+    if (slab->free_list != NULL) {
+        mem = slab->free_list;
+        slab->free_list = *(void **) mem;
+    } else {
+        mem = slab->bump;
+        slab->bump += size;
+    }
+    slab->live++;
+    async_arena_.live++;
+    if (async_slab_full_(slab)) {
+        async_slab_pop_(async_arena_.partial[cls], slab);
+    }
+    memset(mem, 0, size);
+    return mem;
+}
+
+/* Free state allocated by async_new_coro_ */
+static void async_state_release_(struct astate *state) {
+    struct async_slab *slab;
+    char *mem = (char *) state;
+    size_t cls;
+
+    if (!async_in_arena_(state)) {
+        free(state);
+        return;
+    }
+    slab = &async_arena_.slabs[(size_t) (mem - async_arena_.base) / ASYNC_ARENA_SLAB];
+    cls = slab->size / ASYNC_ARENA_ALIGN - 1;
+    if (async_slab_full_(slab)) {
+        async_slab_push_(async_arena_.partial[cls], slab);
+    }
+    *(void **) mem = slab->free_list;
+    slab->free_list = mem;
+    async_arena_.live--;
+    if (--slab->live == 0) {
+        async_slab_pop_(async_arena_.partial[cls], slab);
+        slab->size = 0;
+        async_slab_push_(async_arena_.empty, slab);
+        if (++async_arena_.n_empty > ASYNC_ARENA_KEEP_SLABS) {
+            async_slab_release_(slab);
+        }
+    }
+}
+
+async_error async_arena_reserve(size_t size) {
+#ifdef ASYNC_ARENA_
+    char *mem, *base;
+    size_t n_slabs;
+
+    if (async_arena_.base != NULL) return ASYNC_EINVAL_STATE;
+    n_slabs = (size + ASYNC_ARENA_SLAB - 1) / ASYNC_ARENA_SLAB;
+    if (n_slabs == 0) return ASYNC_ENOMEM;
+    size = n_slabs * ASYNC_ARENA_SLAB;
+    async_arena_.slabs = calloc(n_slabs, sizeof(*async_arena_.slabs));
+    if (async_arena_.slabs == NULL) return ASYNC_ENOMEM;
+    /* Over-reserve by one slab to align the region, so slabs line up with huge pages */
+    mem = mmap(NULL, size + ASYNC_ARENA_SLAB, PROT_READ | PROT_WRITE,
+    #ifdef MAP_NORESERVE
+               MAP_NORESERVE |
+    #endif
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        free(async_arena_.slabs);
+        async_arena_.slabs = NULL;
+        return ASYNC_ENOMEM;
     }
+    base = mem + (ASYNC_ARENA_SLAB - (size_t) mem % ASYNC_ARENA_SLAB) % ASYNC_ARENA_SLAB;
+    if (base != mem) {
+        munmap(mem, (size_t) (base - mem));
+    }
+    munmap(base + size, ASYNC_ARENA_SLAB - (size_t) (base - mem));
+    #ifdef MADV_HUGEPAGE
+    madvise(base, size, MADV_HUGEPAGE);
+    #endif
+    async_arena_.base = base;
+    async_arena_.size = size;
+    return ASYNC_OK;
+#else
+    (void) size;
+    return ASYNC_ENOMEM;
+#endif
+}
+
+/* Like async_state_release_, but leaves arena states to async_arena_reset_ */
+static void async_state_forget_(struct astate *state) {
+    if (!async_in_arena_(state)) {
+        free(state);
+    }
+}
+
+/* Takes back all arena states at once, only valid when every one of them was forgotten */
+static void async_arena_reset_(void) {
+    struct async_slab *slab;
+    size_t i;
+
+    memset(async_arena_.partial, 0, sizeof(async_arena_.partial));
+    for (i = 0; i < async_arena_.carved / ASYNC_ARENA_SLAB; i++) {
+        slab = &async_arena_.slabs[i];
+        if (slab->size == 0) continue; /* already empty or released */
+        slab->live = 0;
+        slab->size = 0;
+        async_slab_push_(async_arena_.empty, slab);
+        if (++async_arena_.n_empty > ASYNC_ARENA_KEEP_SLABS) {
+            async_slab_release_(slab);
+        }
+    }
+    async_arena_.live = 0;
+}
+
+/* Tasks of a destroyed loop are freed slab by slab if they are the only states left in the arena */
+#define async_teardown_bulk_(in_arena) ((in_arena) != 0 && (in_arena) == async_arena_.live)
+
+size_t async_arena_trim(void) {
+    size_t released = 0;
+    while (async_arena_.empty != NULL) {
+        released += async_slab_release_(async_arena_.empty);
+    }
+    return released;
+}
+
+async_error async_arena_release(void) {
+#ifdef ASYNC_ARENA_
+    if (async_arena_.base == NULL || async_arena_.live != 0) return ASYNC_EINVAL_STATE;
+    munmap(async_arena_.base, async_arena_.size);
+    free(async_arena_.slabs);
+    memset(&async_arena_, 0, sizeof(async_arena_));
+    return ASYNC_OK;
+#else
+    return ASYNC_EINVAL_STATE;
+#endif
+}
+
+/* Block is freed together with its last member */
+static void async_block_release_(struct astate *state) {
+    struct async_block *block = async_block_of_(state);
+    if (--block->live == 0) {
+        free(block);
+    }
+}
+
+
+#define ASYNC_LOOP_HEAD   \
+    struct astate *state, *next
+
+#define ASYNC_LOOP_RUNNER_HEAD \
+    ASYNC_LOOP_HEAD;           \
+    int progress;              \
+    size_t runnable;           \
+    double now, wakeup
 
 /*
- * This block is faster than runner because it knows that you don't need event loop anymore,
- * so it can just free and NULL all states without references inside events queue
+ * State can be resumed: it neither waits for a child nor has an armed timer in the future.
+ * State waiting for both child and timer is resumed by whichever fires first.
  */
-#define ASYNC_LOOP_DESTRUCTOR_BLOCK_NOREFS                  \
-    if (state->_refcnt == 0) {                              \
-        if (!async_done(state) && state->_cancel != NULL) { \
-            state->_cancel(state);                          \
-        }                                                   \
-        STATE_FREE(state);                                  \
-        event_loop->events_queue.data[i] = NULL;            \
-        event_loop->vacant_queue.length++;                  \
+#define async_ready_(state, now)                                                     \
+    ((state)->_next                                                                  \
+            ? async_done((state)->_next) || ((state)->_wakeup != 0 && (state)->_wakeup <= (now)) \
+            : (state)->_wakeup <= (now))
+
+/* Keep the nearest armed timer in wakeup */
+#define async_nearest_timer_(state, now, wakeup)                                          \
+    if ((state)->_wakeup > (now)) {                                                       \
+        async_metrics_armed_++;                                                           \
+        if ((wakeup) == 0 || (state)->_wakeup < (wakeup)) (wakeup) = (state)->_wakeup;    \
+    }
+
+/* Append state to the tail of intrusive tasks list */
+#define async_list_append_(head, tail, state)                \
+    {                                                        \
+        (state)->_task_prev = (tail);                        \
+        (state)->_task_next = NULL;                          \
+        if ((tail) != NULL) {                                \
+            (tail)->_task_next = (state);                    \
+        } else {                                             \
+            (head) = (state);                                \
+        }                                                    \
+        (tail) = (state);                                    \
+    } (void) 0
+
+/* Remove state from intrusive tasks list */
+#define async_list_remove_(head, tail, state)                         \
+    {                                                                 \
+        if ((state)->_task_prev != NULL) {                            \
+            (state)->_task_prev->_task_next = (state)->_task_next;    \
+        } else {                                                      \
+            (head) = (state)->_task_next;                             \
+        }                                                             \
+        if ((state)->_task_next != NULL) {                            \
+            (state)->_task_next->_task_prev = (state)->_task_prev;    \
+        } else {                                                      \
+            (tail) = (state)->_task_prev;                             \
+        }                                                             \
+    } (void) 0
+
+/* Append state to the tail of the loop's tasks list */
+#define async_loop_link_(state)                                                    \
+    {                                                                              \
+        async_list_append_(event_loop->tasks_head, event_loop->tasks_tail, state); \
+        event_loop->n_tasks++;                                                     \
+    } (void) 0
+
+/* Remove state from the loop's tasks list */
+#define async_loop_unlink_(state)                                                  \
+    {                                                                              \
+        async_list_remove_(event_loop->tasks_head, event_loop->tasks_tail, state); \
+        event_loop->n_tasks--;                                                     \
+    } (void) 0
+
+/* Nothing references the state, so the loop frees it. Without refcounts it must be done and not owned */
+#ifdef ASYNC_NO_REFCNT
+    #define async_unreferenced_(state) (async_done(state) && !((state)->_flags & _ASYNC_FLAG_OWNED))
+#else
+    #define async_unreferenced_(state) ((state)->_refcnt == 0)
+#endif
+
+#ifdef ASYNC_NO_CANCEL
+    #define async_run_cancel_(state) (void) 0
+    #define async_must_cancel_(state) 0
+#else
+    #define async_run_cancel_(state) if ((state)->_cancel != NULL) (state)->_cancel(state)
+    #define async_must_cancel_(state) ((state)->err != ASYNC_ECANCELED && async_cancelled(state))
+#endif
+
+#define ASYNC_LOOP_BLOCK_NOREFS                                \
+    if (async_unreferenced_(state)) {                          \
+        if (!async_done(state)) {                              \
+            async_run_cancel_(state);                          \
+        }                                                      \
+        async_loop_unlink_(state);                             \
+        STATE_FREE(state);                                     \
     }
 
+#ifdef ASYNC_NO_CANCEL
+#define ASYNC_LOOP_RUNNER_BLOCK_CANCELLED
+#else
 #define ASYNC_LOOP_RUNNER_BLOCK_CANCELLED                               \
-    else if (state->err != ASYNC_ECANCELED && async_cancelled(state)){ \
+    else if (async_must_cancel_(state)) {                               \
         if (!async_done(state)) {                                       \
-            ASYNC_DECREF(state);                                        \
-            if (state->_cancel != NULL) {                               \
-                state->_cancel(state);                                  \
-            }                                                           \
+            _ASYNC_SELF_DECREF(state);                                  \
+            async_run_cancel_(state);                                   \
         }                                                               \
         if (state->_next) {                                             \
             ASYNC_DECREF(state->_next);                                 \
             async_cancel(state->_next);                                 \
+            _ASYNC_SET_PARENT(state->_next, NULL);                      \
+            state->_next = NULL;                                        \
         }                                                               \
         state->err = ASYNC_ECANCELED;                                   \
         state->_async_k = ASYNC_DONE;                                   \
     }
+#endif
 
-#define ASYNC_LOOP_BODY_BEGIN                               \
-    for (i = 0; i < event_loop->events_queue.length; i++) { \
-        state = event_loop->events_queue.data[i];           \
-        if (state == NULL) {                                \
-            continue;                                       \
-        }
+/*
+ * Tasks added while the list is walked are appended to its tail and visited during the same pass,
+ * next is fetched before the state is processed as processing may free it.
+ */
+#define ASYNC_LOOP_BODY_BEGIN                                               \
+    for (state = event_loop->tasks_head; state != NULL; state = next) {     \
+        next = state->_task_next;
 
 
-/* Parent while loop breaks if all array elements are vacant (NULL'ed) */
 #define ASYNC_LOOP_BODY_END \
     }(void)0
 
+/*
+ * Sets progress to 1 if at least one task was resumed, freed or cancelled during the pass,
+ * otherwise wakeup holds the nearest armed timer (or 0) the loop may block until
+ */
 #define ASYNC_LOOP_RUNNER_BODY                                                    \
+    progress = 0;                                                                 \
+    runnable = 0;                                                                 \
+    wakeup = 0;                                                                   \
+    now = event_loop->now = async_monotonic();                                    \
+    async_metrics_begin_();                                                       \
     ASYNC_LOOP_BODY_BEGIN                                                         \
-    ASYNC_LOOP_RUNNER_BLOCK_NOREFS                                                \
+    ASYNC_LOOP_BLOCK_NOREFS                                                       \
     ASYNC_LOOP_RUNNER_BLOCK_CANCELLED                                             \
-    else if (!async_done(state) && (!state->_next || async_done(state->_next))) { \
+    else if (async_done(state)) {                                                 \
+        /* Finished, but still referenced by someone */                           \
+        continue;                                                                 \
+    } else if (!async_ready_(state, now)) {                                       \
+        async_nearest_timer_(state, now, wakeup)                                  \
+        continue;                                                                 \
+    } else {                                                                      \
         /* Nothing special to do with this function, let it run */                \
-        state->_func(state);                                                      \
+        async_disarm_(state);                                                     \
+        async_resume_(state);                                                     \
+        next = state->_task_next; /* pick up tasks it has just added */           \
+        runnable++;                                                               \
     }                                                                             \
-    ASYNC_LOOP_BODY_END
+    progress = 1;                                                                 \
+    ASYNC_LOOP_BODY_END;                                                          \
+    async_set_runnable_(event_loop, runnable);                                    \
+    async_metrics_cycle_();                                                       \
+    async_watch_cycle_()
+
+
+/*
+ * Loop teardown cancels every unfinished task exactly once, parents before the tasks they await,
+ * so cancel callbacks still see their children alive. Refcounts are not maintained: all states are
+ * freed in bulk right after, references held outside of the loop become dangling.
+ */
+static size_t async_teardown_cancel_(struct astate *state) {
+    struct astate *next;
+    size_t n = 0;
+    for (; state != NULL && !async_done(state); state = next, n++) {
+        next = state->_next; /* cancel callbacks may let go of the child */
+#ifndef ASYNC_NO_CANCEL
+        async_cancel(state);
+        async_run_cancel_(state);
+#endif
+        state->err = ASYNC_ECANCELED;
+        state->_async_k = ASYNC_DONE;
+    }
+    return n;
+}
+
+/* Done states may keep a stale _next, only unfinished ones are awaiting something */
+#define async_teardown_mark_(state, awaited)                        \
+    if (!async_done(state) && (state)->_next != NULL) {             \
+        (state)->_next->_flags |= _ASYNC_FLAG_AWAITED;              \
+        (awaited)++;                                                \
+    }
 
+/* Cancels the chain of a task nobody awaits, every cancelled state past its head was awaited */
+#define async_teardown_root_(state, awaited)                        \
+    if (!((state)->_flags & _ASYNC_FLAG_AWAITED)) {                 \
+        size_t n_chain = async_teardown_cancel_(state);             \
+        if (n_chain > 1) (awaited) -= n_chain - 1;                  \
+    }
 
-#define ASYNC_LOOP_DESTRUCTOR_BODY                                \
-    ASYNC_LOOP_BODY_BEGIN                                         \
-    ASYNC_LOOP_DESTRUCTOR_BLOCK_NOREFS                            \
-    ASYNC_LOOP_RUNNER_BLOCK_CANCELLED                             \
-    else if (!async_cancelled(state)) {                           \
-        /* Nothing special to do with this function, cancel it */ \
-        async_cancel(state);                                      \
-        i--;                                                      \
-    }                                                             \
-    ASYNC_LOOP_BODY_END
+/*
+ * Block until the nearest timer if the platform allows it, returns immediately otherwise.
+ * With path watches open it waits on the inotify descriptor, so a change wakes the loop early.
+ */
+static void async_loop_wait_(double wakeup) {
+    double now;
+    if (wakeup == 0) return;
+    now = async_monotonic();
+    if (wakeup > now && (async_watch_poll_(wakeup - now) || async_os_sleep_(wakeup - now))) {
+        event_loop->idle_wakeups++;
+        event_loop->now = async_monotonic();
+    }
+}
 
 static void async_loop_run_forever_(void) {
-    ASYNC_LOOP_HEAD;
-    while (event_loop->events_queue.length > 0 && event_loop->events_queue.length > event_loop->vacant_queue.length) {
+    ASYNC_LOOP_RUNNER_HEAD;
+    while (event_loop->tasks_head != NULL) {
         ASYNC_LOOP_RUNNER_BODY;
+        if (!progress) {
+            async_loop_wait_(wakeup);
+        }
     }
+    event_loop->now = 0;
 }
 
 
 static void async_loop_run_until_complete_(struct astate *main) {
-    ASYNC_LOOP_HEAD;
+    ASYNC_LOOP_RUNNER_HEAD;
     if (main == NULL) {
         return;
     }
-    while (main->_func(main) != ASYNC_DONE) {
+    event_loop->now = async_monotonic();
+    while (async_resume_(main) != ASYNC_DONE) {
         ASYNC_LOOP_RUNNER_BODY;
+        if (!progress && !async_ready_(main, now)) {
+            async_nearest_timer_(main, now, wakeup)
+            async_loop_wait_(wakeup);
+        }
     }
-    if (main->_refcnt == 0) {
+    event_loop->now = 0;
+    if (async_unreferenced_(main)) {
         STATE_FREE(main);
     }
 }
 
 static void async_loop_init_(void) {
-    async_arr_init(&event_loop->events_queue);
-    async_arr_init(&event_loop->vacant_queue);
+    event_loop->tasks_head = event_loop->tasks_tail = NULL;
+    event_loop->idle_wakeups = 0;
+    event_loop->n_tasks = 0;
+    event_loop->n_runnable = 0;
+    event_loop->rejected_tasks = 0;
+    event_loop->deadline_misses = 0;
 }
 
 static void async_loop_destroy_(void) {
     ASYNC_LOOP_HEAD;
-    while (event_loop->events_queue.length > 0 && event_loop->events_queue.length > event_loop->vacant_queue.length) {
-        ASYNC_LOOP_DESTRUCTOR_BODY;
+    size_t awaited = 0, in_arena = 0;
+    int bulk;
+    for (state = event_loop->tasks_head; state != NULL; state = state->_task_next) {
+        async_teardown_mark_(state, awaited)
+    }
+    /* Cancel callbacks may add tasks, they are appended to the tail and visited as roots */
+    for (state = event_loop->tasks_head; state != NULL; state = state->_task_next) {
+        async_teardown_root_(state, awaited)
+    }
+    /* Some tasks are awaited by parents living outside of this loop */
+    for (state = event_loop->tasks_head; awaited != 0 && state != NULL; state = state->_task_next) {
+        async_teardown_cancel_(state);
+    }
+    for (state = event_loop->tasks_head; state != NULL; state = state->_task_next) {
+        in_arena += async_in_arena_(state);
     }
-    async_arr_destroy(&event_loop->events_queue);
-    async_arr_destroy(&event_loop->vacant_queue);
+    bulk = async_teardown_bulk_(in_arena);
+    for (state = event_loop->tasks_head; state != NULL; state = next) {
+        next = state->_task_next;
+        STATE_FREE_WITH_(state, bulk ? async_state_forget_ : async_state_release_);
+    }
+    if (bulk) {
+        async_arena_reset_();
+    }
+    event_loop->tasks_head = event_loop->tasks_tail = NULL;
+    event_loop->n_tasks = 0;
+    event_loop->n_runnable = 0;
 }
 
-#define async_set_sheduled(state) ((state)->_flags |= _ASYNC_FLAG_SHEDULED)
+#ifdef ASYNC_PROFILE
+    #define async_set_sheduled(state) \
+        ((state)->_flags |= _ASYNC_FLAG_SHEDULED, async_critpath_on_ ? async_critpath_spawned_(state) : (void) 0)
+#else
+    #define async_set_sheduled(state) ((state)->_flags |= _ASYNC_FLAG_SHEDULED)
+#endif
 
 #define async_sheduled(state) (!!((state)->_flags & _ASYNC_FLAG_SHEDULED))
 
-static struct astate *async_loop_add_task_(struct astate *state) {
-    size_t i;
+/* Returns 0 and counts rejection if adding n more tasks would exceed loop limits */
+static int async_loop_admit_(size_t n) {
+    if (!async_has_capacity(n)) {
+        event_loop->rejected_tasks += n;
+        return 0;
+    }
+    return 1;
+}
+
+static ASYNC_INLINE struct astate *async_loop_add_task_(struct astate *state) {
     if (state == NULL) return NULL;
 
     if (!async_sheduled(state)) {
-        if (event_loop->vacant_queue.length > 0) {
-            i = async_arr_pop(&event_loop->vacant_queue);
-            event_loop->events_queue.data[i] = state;
-        } else {
-            if (!async_arr_push(&event_loop->events_queue, state)) {
-                STATE_FREE(state);
-                return NULL;
-            }
+        if (!async_loop_admit_(1)) {
+            STATE_FREE(state);
+            return NULL;
         }
+        async_loop_link_(state);
         async_set_sheduled(state);
     }
     return state;
 }
 
 static struct astate **async_loop_add_tasks_(size_t n, struct astate **states) {
-    size_t i;
-    if (states == NULL || !async_all_(n, states) || !async_arr_reserve(&event_loop->events_queue, n)) { return NULL; }
+    size_t i, n_new = 0;
+    if (states == NULL || !async_all_(n, states)) { return NULL; }
+    for (i = 0; i < n; i++) {
+        if (!async_sheduled(states[i])) n_new++;
+    }
+    if (!async_loop_admit_(n_new)) { return NULL; }
     for (i = 0; i < n; i++) {
         if (!async_sheduled(states[i])) {
-            /* push would never fail here as we've reserved enough memory already, no need to check the return value */
-            async_arr_push(&event_loop->events_queue, states[i]);
+            async_loop_link_(states[i]);
             async_set_sheduled(states[i]);
         }
     }
     return states;
 }
 
-struct astate *async_new_coro_(AsyncCallback child_f, void *args, size_t stack_size, size_t stack_offset) {
-    struct astate *state;
-    size_t padding;
+int async_has_capacity(size_t n) {
+    return (event_loop->max_tasks == 0 || event_loop->n_tasks + n <= event_loop->max_tasks) &&
+           (event_loop->max_runnable == 0 || event_loop->n_runnable < event_loop->max_runnable);
+}
 
-    padding = stack_offset - sizeof(*state);
-    state = calloc(1, sizeof(*state) + padding + stack_size);
-    if (state == NULL) { return NULL; }
-    state->locals = ((char *) state) + stack_offset;
-    state->args = args;
-    state->_func = child_f;
-    state->_refcnt = 1; /* State has 1 reference set as function "owns" itself until exited or cancelled */
-    /* state->_async_k = ASYNC_INIT; state is already ASYNC_INIT because calloc */
-    return state;
+int async_capacity_wait_(size_t n) {
+    if (async_has_capacity(n)) return 0;
+    async_capacity_waits_++;
+    return 1;
 }
 
-void async_free_coro_(struct astate *state) {
-    if (state != NULL) {
-        STATE_FREE(state);
-    }
+async_error async_create_error(size_t n) {
+    return async_has_capacity(n) ? ASYNC_ENOMEM : ASYNC_EAGAIN;
 }
 
-void async_free_coros_(size_t n, struct astate **states) {
-    while (n--) {
-        if (states[n]) STATE_FREE(states[n]);
+/* async_create_task[s] of translation units the library is compiled into, default loop is called directly */
+static ASYNC_INLINE struct astate *async_add_task_(struct astate *state) {
+    if (event_loop == &async_standard_event_loop_) {
+        return async_loop_add_task_(state);
     }
+    return event_loop->add_task(state);
 }
 
-static async async_yielder(struct astate *state) {
-    async_begin(state);
-            async_yield;
-    async_end;
+static ASYNC_INLINE struct astate **async_add_tasks_(size_t n, struct astate **states) {
+    if (event_loop == &async_standard_event_loop_) {
+        return async_loop_add_tasks_(n, states);
+    }
+    return event_loop->add_tasks(n, states);
 }
 
+/*
+ * Structure-of-arrays event loop.
+ * Every task owns a slot, status of the slot is mirrored into a byte array after each visit, so a loop cycle
+ * only scans status bytes for READY slots and dereferences nothing else. Slots waiting for a child are
+ * made READY when the child finishes, timer slots when their wakeup is popped from a min-heap of armed
+ * timers. States cancelled or released by other tasks are made READY by the loop's wake hook, a sweep
+ * every ASYNC_SOA_SWEEP_TICKS cycles picks up any other change made from outside.
+ */
+#define ASYNC_SLOT_FREE        0
+#define ASYNC_SLOT_READY       1 /* must be visited during the next cycle */
+#define ASYNC_SLOT_CHILD       2 /* waits for the child in waiter table */
+#define ASYNC_SLOT_TIMER       3 /* waits for its wakeup */
+#define ASYNC_SLOT_CHILD_TIMER 4 /* waits for the child or wakeup, whichever comes first */
+#define ASYNC_SLOT_DONE        5 /* finished, but still referenced */
+
+#define ASYNC_SLOT_NONE ((unsigned int) -1)
+
+/* Status table is scanned in blocks of this many bytes, its capacity is always a multiple of it */
+#define ASYNC_SOA_BLOCK 32
+
+/* Entry of the timer heap, stale once wakeup of its slot no longer matches */
+struct async_soa_timer_ {
+    double wakeup;
+    unsigned int slot;
+};
+
 typedef struct {
-    async_arr_t(struct astate *) arr_coros;
-} gathered_stack;
+    struct async_event_loop base;
+    struct astate **states;
+    unsigned char *status;
+    double *wakeup; /* timer the slot has an entry in the heap for, 0 if it has none */
+    unsigned int *waiter; /* slot of the task waiting for this one to finish */
+    size_t length, capacity;
+    async_arr_t(unsigned int) vacant;
+    async_arr_t(struct async_soa_timer_) timers; /* min-heap by wakeup */
+    size_t armed; /* slots with non-zero wakeup, the rest of the heap is stale */
+    unsigned long ticks;
+} async_soa_loop;
 
-static void async_gatherer_cancel(struct astate *state) {
-    gathered_stack *locals = state->locals;
-    size_t i;
-    for (i = 0; i < locals->arr_coros.length; i++) {
-        ASYNC_DECREF(locals->arr_coros.data[i]);
-        async_cancel(locals->arr_coros.data[i]);
-    }
-}
+static void async_soa_init_(void);
 
-static async async_gatherer(struct astate *state) {
-    gathered_stack *locals = state->locals;
-    size_t i;
-    struct astate *child;
-    async_begin(state);
-            while (1) {
-                for (i = 0; i < locals->arr_coros.length; i++) {
-                    child = locals->arr_coros.data[i];
-                    if (!async_done(child)) {
+static void async_soa_destroy_(void);
+
+static struct astate *async_soa_add_task_(struct astate *state);
+
+static struct astate **async_soa_add_tasks_(size_t n, struct astate **states);
+
+static void async_soa_run_forever_(void);
+
+static void async_soa_run_until_complete_(struct astate *main);
+
+static void async_soa_wake_(struct astate *state);
+
+static async_soa_loop async_soa_loop_ = {
+        {
+                async_soa_init_,
+                async_soa_destroy_,
+                async_soa_add_task_,
+                async_soa_add_tasks_,
+                async_soa_run_forever_,
+                async_soa_run_until_complete_,
+                NULL,
+                NULL,
+                0,
+                0,
+                0,
+                0, 0,
+                0, 0,
+                0,
+                0,
+                0,
+                async_soa_wake_
+        },
+        NULL, NULL, NULL, NULL,
+        0, 0,
+        {0, 0, 0},
+        {NULL, 0, 0},
+        0,
+        0
+};
+
+struct async_event_loop *async_soa_event_loop = &async_soa_loop_.base;
+
+#define async_soa_get_() ((async_soa_loop *) event_loop)
+
+#if defined(ASYNC_SIMD_AVX2_) || defined(ASYNC_SIMD_SSE2_)
+static unsigned int async_ctz_(unsigned int x) {
+#if defined(__GNUC__)
+    return (unsigned int) __builtin_ctz(x);
+#elif defined(_MSC_VER)
+    unsigned long i;
+    _BitScanForward(&i, x);
+    return (unsigned int) i;
+#else
+    unsigned int i = 0;
+    while (!(x & 1u)) {
+        x >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+#endif
+
+/* Index of the first byte equal to value in status[from, n), n if there's none. n must be a multiple of ASYNC_SOA_BLOCK */
+static size_t async_soa_find_(const unsigned char *status, size_t from, size_t n, unsigned char value) {
+#if defined(ASYNC_SIMD_AVX2_)
+    __m256i needle = _mm256_set1_epi8((char) value);
+    size_t base = from & ~(size_t) 31;
+    unsigned int mask;
+    for (; base < n; base += 32) {
+        mask = (unsigned int) _mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (status + base)), needle));
+        mask &= ~0u << (from > base ? from - base : 0);
+        if (mask) return base + async_ctz_(mask);
+    }
+    return n;
+#elif defined(ASYNC_SIMD_SSE2_)
+    __m128i needle = _mm_set1_epi8((char) value);
+    size_t base = from & ~(size_t) 15;
+    unsigned int mask;
+    for (; base < n; base += 16) {
+        mask = (unsigned int) _mm_movemask_epi8(
+                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (status + base)), needle));
+        mask &= ~0u << (from > base ? from - base : 0);
+        if (mask) return base + async_ctz_(mask);
+    }
+    return n;
+#else
+    for (; from < n; from++) {
+        if (status[from] == value) return from;
+    }
+    return n;
+#endif
+}
+
+static int async_soa_grow_(async_soa_loop *loop) {
+    size_t n = loop->capacity ? loop->capacity << 1 : ASYNC_SOA_BLOCK;
+    void *mem;
+
+    mem = realloc(loop->states, n * sizeof(*loop->states));
+    if (mem == NULL) return 0;
+    loop->states = mem;
+    mem = realloc(loop->wakeup, n * sizeof(*loop->wakeup));
+    if (mem == NULL) return 0;
+    loop->wakeup = mem;
+    mem = realloc(loop->waiter, n * sizeof(*loop->waiter));
+    if (mem == NULL) return 0;
+    loop->waiter = mem;
+    mem = realloc(loop->status, n);
+    if (mem == NULL) return 0;
+    loop->status = mem;
+    memset(loop->status + loop->capacity, ASYNC_SLOT_FREE, n - loop->capacity);
+    for (; loop->capacity < n; loop->capacity++) {
+        loop->wakeup[loop->capacity] = 0;
+    }
+    return 1;
+}
+
+/* Wake the task waiting for slot to finish */
+static void async_soa_notify_(async_soa_loop *loop, size_t slot) {
+    unsigned int w = loop->waiter[slot];
+    if (w != ASYNC_SLOT_NONE) {
+        if (loop->status[w] == ASYNC_SLOT_CHILD || loop->status[w] == ASYNC_SLOT_CHILD_TIMER) {
+            loop->status[w] = ASYNC_SLOT_READY;
+        }
+        loop->waiter[slot] = ASYNC_SLOT_NONE;
+    }
+}
+
+/* Slot of a state scheduled by this loop, ASYNC_SLOT_NONE if it isn't */
+static unsigned int async_soa_slot_of_(async_soa_loop *loop, struct astate *state) {
+    if (state != NULL && async_sheduled(state) && state->_slot < loop->length && loop->states[state->_slot] == state) {
+        return state->_slot;
+    }
+    return ASYNC_SLOT_NONE;
+}
+
+static void async_soa_release_(async_soa_loop *loop, size_t slot) {
+    async_soa_notify_(loop, slot);
+    loop->states[slot] = NULL;
+    loop->status[slot] = ASYNC_SLOT_FREE;
+    loop->base.n_tasks--;
+    async_arr_push(&loop->vacant, (unsigned int) slot); /* slot is just never reused if push fails */
+}
+
+static struct async_soa_timer_ async_soa_timer_pop_(async_soa_loop *loop) {
+    struct async_soa_timer_ *heap = loop->timers.data;
+    struct async_soa_timer_ top = heap[0], last = heap[--loop->timers.length];
+    size_t i = 0, child, n = loop->timers.length;
+    while ((child = 2 * i + 1) < n) {
+        if (child + 1 < n && heap[child + 1].wakeup < heap[child].wakeup) child++;
+        if (heap[child].wakeup >= last.wakeup) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    if (n > 0) heap[i] = last;
+    return top;
+}
+
+static void async_soa_timer_push_(async_soa_loop *loop, struct async_soa_timer_ timer) {
+    struct async_soa_timer_ *heap = loop->timers.data;
+    size_t i, parent;
+    for (i = loop->timers.length++; i > 0 && heap[parent = (i - 1) / 2].wakeup > timer.wakeup; i = parent) {
+        heap[i] = heap[parent];
+    }
+    heap[i] = timer;
+}
+
+/* Rebuild the heap from armed slots once stale entries outnumber them */
+static void async_soa_timers_compact_(async_soa_loop *loop) {
+    struct async_soa_timer_ timer;
+    size_t i;
+    loop->timers.length = 0;
+    for (i = 0; i < loop->length; i++) {
+        if (loop->wakeup[i] == 0) continue;
+        timer.wakeup = loop->wakeup[i];
+        timer.slot = (unsigned int) i;
+        async_soa_timer_push_(loop, timer);
+    }
+}
+
+/* Give slot a heap entry for wakeup, an entry it had for another time becomes stale. Returns 0 if out of memory */
+static int async_soa_arm_(async_soa_loop *loop, size_t slot, double wakeup) {
+    struct async_soa_timer_ timer;
+    if (loop->wakeup[slot] == 0) loop->armed++;
+    loop->wakeup[slot] = 0;
+    if (loop->timers.length >= 2 * loop->armed + ASYNC_SOA_BLOCK) {
+        async_soa_timers_compact_(loop);
+    }
+    if (!async_arr_reserve(&loop->timers, 1)) {
+        loop->armed--;
+        return 0;
+    }
+    timer.wakeup = wakeup;
+    timer.slot = (unsigned int) slot;
+    async_soa_timer_push_(loop, timer);
+    loop->wakeup[slot] = wakeup;
+    return 1;
+}
+
+/* Mirror state's status into the table after it was visited */
+static void async_soa_classify_(async_soa_loop *loop, size_t slot, double now) {
+    struct astate *state = loop->states[slot];
+    unsigned int child;
+    unsigned char status = ASYNC_SLOT_READY;
+
+    if (async_unreferenced_(state) || async_must_cancel_(state)) {
+        status = ASYNC_SLOT_READY;
+    } else if (async_done(state)) {
+        status = ASYNC_SLOT_DONE;
+        async_soa_notify_(loop, slot);
+    } else if (state->_next && !async_done(state->_next)) {
+        child = async_soa_slot_of_(loop, state->_next);
+        if (child != ASYNC_SLOT_NONE) {
+            loop->waiter[child] = (unsigned int) slot;
+            status = state->_wakeup != 0 ? ASYNC_SLOT_CHILD_TIMER : ASYNC_SLOT_CHILD;
+        }
+    } else if (state->_wakeup > now) {
+        status = ASYNC_SLOT_TIMER;
+    }
+    if ((status == ASYNC_SLOT_TIMER || status == ASYNC_SLOT_CHILD_TIMER) && loop->wakeup[slot] != state->_wakeup &&
+        !async_soa_arm_(loop, slot, state->_wakeup)) {
+        status = ASYNC_SLOT_READY; /* no memory for the heap entry, poll it instead */
+    }
+    loop->status[slot] = status;
+}
+
+/* Make READY timer slots that are due, dropping stale heap entries on the way */
+static void async_soa_expire_timers_(async_soa_loop *loop, double now) {
+    struct async_soa_timer_ top;
+    while (loop->timers.length > 0 && loop->timers.data[0].wakeup <= now) {
+        top = async_soa_timer_pop_(loop);
+        if (loop->wakeup[top.slot] != top.wakeup) continue;
+        loop->wakeup[top.slot] = 0;
+        loop->armed--;
+        if (loop->status[top.slot] == ASYNC_SLOT_TIMER || loop->status[top.slot] == ASYNC_SLOT_CHILD_TIMER) {
+            loop->status[top.slot] = ASYNC_SLOT_READY;
+        }
+    }
+}
+
+/* Nearest wakeup in the heap, 0 if there's none. Stale entries only make the loop wake up early */
+#define async_soa_next_timer_(loop) ((loop)->timers.length > 0 ? (loop)->timers.data[0].wakeup : 0)
+
+/* Revisit every waiting task to pick up changes made by other tasks */
+static void async_soa_sweep_(async_soa_loop *loop) {
+    size_t i;
+    for (i = 0; i < loop->length; i++) {
+        if (loop->status[i] != ASYNC_SLOT_FREE) {
+            loop->status[i] = ASYNC_SLOT_READY;
+        }
+    }
+}
+
+/* Make the task's slot READY, called when the task is cancelled or released from outside of its own resume */
+static void async_soa_wake_(struct astate *state) {
+    async_soa_loop *loop = async_soa_get_();
+    unsigned int slot = async_soa_slot_of_(loop, state);
+    if (slot != ASYNC_SLOT_NONE) {
+        loop->status[slot] = ASYNC_SLOT_READY;
+    }
+}
+
+/* Visit READY slot, returns 1 if task made progress */
+static int async_soa_visit_(async_soa_loop *loop, size_t slot, double now, size_t *runnable) {
+    struct astate *state = loop->states[slot];
+    struct astate *child = state->_next;
+    unsigned int child_slot;
+
+    if (async_unreferenced_(state)) {
+        if (!async_done(state)) {
+            async_run_cancel_(state);
+        }
+        async_soa_release_(loop, slot);
+        STATE_FREE(state);
+        return 1;
+    }
+    ASYNC_LOOP_RUNNER_BLOCK_CANCELLED
+    else if (async_done(state) || !async_ready_(state, now)) {
+        async_soa_classify_(loop, slot, now);
+        return 0;
+    } else {
+        async_disarm_(state);
+        async_resume_(state);
+        (*runnable)++;
+    }
+    async_soa_classify_(loop, slot, now);
+    if (child != NULL && (child != state->_next || async_done(state))) {
+        /* awaited child was released or cancelled, let it be freed */
+        child_slot = async_soa_slot_of_(loop, child);
+        if (child_slot != ASYNC_SLOT_NONE) {
+            loop->status[child_slot] = ASYNC_SLOT_READY;
+        }
+    }
+    return 1;
+}
+
+/* Run single loop cycle, returns 1 if at least one task made progress */
+static int async_soa_tick_(async_soa_loop *loop) {
+    size_t i, runnable = 0;
+    int progress = 0;
+    double now = loop->base.now = async_monotonic();
+
+    async_metrics_begin_();
+    if (++loop->ticks % ASYNC_SOA_SWEEP_TICKS == 0) {
+        async_soa_sweep_(loop);
+    }
+    async_soa_expire_timers_(loop, now);
+    /* table might grow while tasks run, so its pointers and bounds are reloaded on every step */
+    for (i = async_soa_find_(loop->status, 0, loop->capacity, ASYNC_SLOT_READY);
+         i < loop->capacity;
+         i = async_soa_find_(loop->status, i + 1, loop->capacity, ASYNC_SLOT_READY)) {
+        progress |= async_soa_visit_(loop, i, now, &runnable);
+    }
+    async_set_runnable_(&loop->base, runnable);
+    async_metrics_armed_ = (unsigned long) loop->armed; /* parked slots aren't visited, the heap knows them */
+    async_metrics_cycle_();
+    async_watch_cycle_();
+    return progress;
+}
+
+/* Nothing ran during the cycle, block until the nearest timer */
+static void async_soa_idle_(async_soa_loop *loop, struct astate *main) {
+    double wakeup = async_soa_next_timer_(loop);
+    if (main != NULL) {
+        async_nearest_timer_(main, loop->base.now, wakeup)
+    }
+    async_loop_wait_(wakeup);
+}
+
+static void async_soa_init_(void) {
+    async_soa_loop *loop = async_soa_get_();
+    loop->base.tasks_head = loop->base.tasks_tail = NULL;
+    loop->base.idle_wakeups = 0;
+    loop->base.n_tasks = 0;
+    loop->base.n_runnable = 0;
+    loop->base.rejected_tasks = 0;
+    loop->states = NULL;
+    loop->status = NULL;
+    loop->wakeup = NULL;
+    loop->waiter = NULL;
+    loop->length = loop->capacity = 0;
+    async_arr_init(&loop->vacant);
+    async_arr_init(&loop->timers);
+    loop->armed = 0;
+    loop->ticks = 0;
+}
+
+static void async_soa_destroy_(void) {
+    async_soa_loop *loop = async_soa_get_();
+    size_t i, awaited = 0, in_arena = 0;
+    int bulk;
+
+    for (i = 0; i < loop->length; i++) {
+        if (loop->status[i] == ASYNC_SLOT_FREE) continue;
+        async_teardown_mark_(loop->states[i], awaited)
+    }
+    for (i = 0; i < loop->length; i++) {
+        if (loop->status[i] == ASYNC_SLOT_FREE) continue;
+        async_teardown_root_(loop->states[i], awaited)
+    }
+    for (i = 0; awaited != 0 && i < loop->length; i++) {
+        if (loop->status[i] == ASYNC_SLOT_FREE) continue;
+        async_teardown_cancel_(loop->states[i]);
+    }
+    for (i = 0; i < loop->length; i++) {
+        if (loop->status[i] == ASYNC_SLOT_FREE) continue;
+        in_arena += async_in_arena_(loop->states[i]);
+    }
+    bulk = async_teardown_bulk_(in_arena);
+    for (i = 0; i < loop->length; i++) {
+        if (loop->status[i] == ASYNC_SLOT_FREE) continue;
+        STATE_FREE_WITH_(loop->states[i], bulk ? async_state_forget_ : async_state_release_);
+    }
+    if (bulk) {
+        async_arena_reset_();
+    }
+    free(loop->states);
+    free(loop->status);
+    free(loop->wakeup);
+    free(loop->waiter);
+    async_arr_destroy(&loop->vacant);
+    async_arr_destroy(&loop->timers);
+    async_soa_init_();
+}
+
+static struct astate *async_soa_add_task_(struct astate *state) {
+    async_soa_loop *loop = async_soa_get_();
+    unsigned int slot;
+    if (state == NULL) return NULL;
+
+    if (!async_sheduled(state)) {
+        if (!async_loop_admit_(1)) {
+            STATE_FREE(state);
+            return NULL;
+        }
+        if (loop->vacant.length > 0) {
+            slot = async_arr_pop(&loop->vacant);
+        } else {
+            if (loop->length == loop->capacity && !async_soa_grow_(loop)) {
+                STATE_FREE(state);
+                return NULL;
+            }
+            slot = (unsigned int) loop->length++;
+        }
+        loop->states[slot] = state;
+        loop->status[slot] = ASYNC_SLOT_READY;
+        loop->waiter[slot] = ASYNC_SLOT_NONE;
+        state->_slot = slot;
+        loop->base.n_tasks++;
+        async_set_sheduled(state);
+    }
+    return state;
+}
+
+static struct astate **async_soa_add_tasks_(size_t n, struct astate **states) {
+    async_soa_loop *loop = async_soa_get_();
+    size_t i, n_new = 0;
+    if (states == NULL || !async_all_(n, states)) { return NULL; }
+    for (i = 0; i < n; i++) {
+        if (!async_sheduled(states[i])) n_new++;
+    }
+    if (!async_loop_admit_(n_new)) { return NULL; }
+    while (loop->capacity - loop->length + loop->vacant.length < n_new) {
+        if (!async_soa_grow_(loop)) {
+            return NULL;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        /* never fails here as there are enough slots already */
+        async_soa_add_task_(states[i]);
+    }
+    return states;
+}
+
+static void async_soa_run_forever_(void) {
+    async_soa_loop *loop = async_soa_get_();
+    while (loop->base.n_tasks > 0) {
+        if (!async_soa_tick_(loop)) {
+            async_soa_idle_(loop, NULL);
+        }
+    }
+    loop->base.now = 0;
+}
+
+static void async_soa_run_until_complete_(struct astate *main) {
+    async_soa_loop *loop = async_soa_get_();
+    if (main == NULL) {
+        return;
+    }
+    loop->base.now = async_monotonic();
+    while (async_resume_(main) != ASYNC_DONE) {
+        if (!async_soa_tick_(loop) && !async_ready_(main, loop->base.now)) {
+            async_soa_idle_(loop, main);
+        }
+    }
+    loop->base.now = 0;
+    if (async_unreferenced_(main)) {
+        STATE_FREE(main);
+    }
+}
+
+/*
+ * Multi-level feedback queue event loop.
+ * Tasks are kept in ASYNC_MLFQ_LEVELS lists, level 0 being the loop's tasks list, and tasks of level n are
+ * visited once in 2^n cycles. Resume that returns from the same await(cond) with the condition still
+ * unmet and without parking the task on a child or timer counts as idle, ASYNC_MLFQ_DEMOTE_AFTER idle
+ * resumes in a row demote the task one level down. Any other resume (progress, async_yield, parking or
+ * finishing) promotes it back to level 0, so busy workers that yield stay on top and demoted levels only
+ * ever hold polling tasks.
+ */
+typedef struct {
+    struct async_event_loop base;
+    struct astate *head[ASYNC_MLFQ_LEVELS], *tail[ASYNC_MLFQ_LEVELS]; /* level 0 uses base tasks list instead */
+    unsigned long ticks;
+} async_mlfq_loop;
+
+static void async_mlfq_init_(void);
+
+static void async_mlfq_destroy_(void);
+
+static void async_mlfq_run_forever_(void);
+
+static void async_mlfq_run_until_complete_(struct astate *main);
+
+static async_mlfq_loop async_mlfq_loop_ = {
+        {
+                async_mlfq_init_,
+                async_mlfq_destroy_,
+                async_loop_add_task_,
+                async_loop_add_tasks_,
+                async_mlfq_run_forever_,
+                async_mlfq_run_until_complete_,
+                NULL,
+                NULL,
+                0,
+                0,
+                0,
+                0, 0,
+                0, 0,
+                0,
+                0,
+                0,
+                NULL
+        },
+        {NULL},
+        {NULL},
+        0
+};
+
+struct async_event_loop *async_mlfq_event_loop = &async_mlfq_loop_.base;
+
+#define async_mlfq_get_() ((async_mlfq_loop *) event_loop)
+
+#define async_mlfq_head_(loop, level) (*((level) == 0 ? &(loop)->base.tasks_head : &(loop)->head[level]))
+
+#define async_mlfq_tail_(loop, level) (*((level) == 0 ? &(loop)->base.tasks_tail : &(loop)->tail[level]))
+
+/* Move state between levels according to what its last resume did */
+static void async_mlfq_feedback_(async_mlfq_loop *loop, struct astate *state, unsigned int level, unsigned int k) {
+    unsigned int to = level;
+    if (async_done(state) || !(state->_flags & _ASYNC_FLAG_POLLING) || state->_async_k != k ||
+        state->_next != NULL || state->_wakeup != 0) {
+        state->_idle = 0;
+        to = 0;
+    } else if (state->_idle < ASYNC_MLFQ_DEMOTE_AFTER && ++state->_idle == ASYNC_MLFQ_DEMOTE_AFTER &&
+               level + 1 < ASYNC_MLFQ_LEVELS) {
+        state->_idle = 0;
+        to = level + 1;
+    }
+    if (to != level) {
+        async_list_remove_(async_mlfq_head_(loop, level), async_mlfq_tail_(loop, level), state);
+        async_list_append_(async_mlfq_head_(loop, to), async_mlfq_tail_(loop, to), state);
+        state->_level = (unsigned char) to;
+    }
+}
+
+/*
+ * Visit every due level once, returns 1 if anything was resumed, freed or cancelled, or if levels that weren't
+ * due hold polling tasks. Tasks added or moved during the cycle are appended behind the snapshot of each level's
+ * tail and visited on the next cycle. Otherwise wakeup holds the nearest timer.
+ */
+static int async_mlfq_tick_(async_mlfq_loop *loop, double *wakeup) {
+    struct astate *state, *next, *last;
+    unsigned int level, k;
+    size_t runnable = 0;
+    int progress = 0;
+    double now = loop->base.now = async_monotonic();
+
+    async_metrics_begin_();
+    *wakeup = 0;
+    loop->ticks++;
+    for (level = 0; level < ASYNC_MLFQ_LEVELS; level++) {
+        if (async_mlfq_head_(loop, level) == NULL) continue;
+        if (loop->ticks % (1UL << level) != 0) {
+            progress = 1;
+            continue;
+        }
+        last = async_mlfq_tail_(loop, level);
+        for (state = async_mlfq_head_(loop, level); state != NULL; state = next) {
+            next = state == last ? NULL : state->_task_next;
+            if (async_unreferenced_(state)) {
+                if (!async_done(state)) {
+                    async_run_cancel_(state);
+                }
+                async_list_remove_(async_mlfq_head_(loop, level), async_mlfq_tail_(loop, level), state);
+                loop->base.n_tasks--;
+                STATE_FREE(state);
+            }
+            ASYNC_LOOP_RUNNER_BLOCK_CANCELLED
+            else if (async_done(state)) {
+                continue;
+            } else if (!async_ready_(state, now)) {
+                async_nearest_timer_(state, now, *wakeup)
+                continue;
+            } else {
+                k = state->_async_k;
+                async_disarm_(state);
+                async_resume_(state);
+                runnable++;
+                async_mlfq_feedback_(loop, state, level, k);
+            }
+            progress = 1;
+        }
+    }
+    async_set_runnable_(&loop->base, runnable);
+    async_metrics_cycle_();
+    async_watch_cycle_();
+    return progress;
+}
+
+static void async_mlfq_init_(void) {
+    async_mlfq_loop *loop = async_mlfq_get_();
+    unsigned int level;
+    async_loop_init_();
+    for (level = 0; level < ASYNC_MLFQ_LEVELS; level++) {
+        loop->head[level] = loop->tail[level] = NULL;
+    }
+    loop->ticks = 0;
+}
+
+/* Splice all levels into the tasks list and tear it down as the default loop does */
+static void async_mlfq_destroy_(void) {
+    async_mlfq_loop *loop = async_mlfq_get_();
+    unsigned int level;
+    for (level = 1; level < ASYNC_MLFQ_LEVELS; level++) {
+        if (loop->head[level] == NULL) continue;
+        if (loop->base.tasks_tail != NULL) {
+            loop->base.tasks_tail->_task_next = loop->head[level];
+            loop->head[level]->_task_prev = loop->base.tasks_tail;
+        } else {
+            loop->base.tasks_head = loop->head[level];
+        }
+        loop->base.tasks_tail = loop->tail[level];
+        loop->head[level] = loop->tail[level] = NULL;
+    }
+    async_loop_destroy_();
+}
+
+static void async_mlfq_run_forever_(void) {
+    async_mlfq_loop *loop = async_mlfq_get_();
+    double wakeup;
+    while (loop->base.n_tasks > 0) {
+        if (!async_mlfq_tick_(loop, &wakeup)) {
+            async_loop_wait_(wakeup);
+        }
+    }
+    loop->base.now = 0;
+}
+
+static void async_mlfq_run_until_complete_(struct astate *main) {
+    async_mlfq_loop *loop = async_mlfq_get_();
+    double wakeup;
+    if (main == NULL) {
+        return;
+    }
+    loop->base.now = async_monotonic();
+    while (async_resume_(main) != ASYNC_DONE) {
+        if (!async_mlfq_tick_(loop, &wakeup) && !async_ready_(main, loop->base.now)) {
+            async_nearest_timer_(main, loop->base.now, wakeup)
+            async_loop_wait_(wakeup);
+        }
+    }
+    loop->base.now = 0;
+    if (async_unreferenced_(main)) {
+        STATE_FREE(main);
+    }
+}
+
+/*
+ * Earliest-deadline-first event loop.
+ * Tasks live in the loop's tasks list like in the default loop. Every cycle collects runnable tasks with
+ * deadline into a binary min-heap and the ones without into background array, then resumes the heap
+ * in deadline order and the background after it. Task found past its deadline when popped is counted
+ * once in deadline_misses and either moved to the background or cancelled with shed_late.
+ * Tasks added during a cycle are resumed on the next one.
+ */
+typedef struct {
+    struct async_event_loop base;
+    async_arr_t(struct astate *) heap;
+    async_arr_t(struct astate *) background;
+} async_edf_loop;
+
+static void async_edf_init_(void);
+
+static void async_edf_destroy_(void);
+
+static void async_edf_run_forever_(void);
+
+static void async_edf_run_until_complete_(struct astate *main);
+
+static async_edf_loop async_edf_loop_ = {
+        {
+                async_edf_init_,
+                async_edf_destroy_,
+                async_loop_add_task_,
+                async_loop_add_tasks_,
+                async_edf_run_forever_,
+                async_edf_run_until_complete_,
+                NULL,
+                NULL,
+                0,
+                0,
+                0,
+                0, 0,
+                0, 0,
+                0,
+                0,
+                0,
+                NULL
+        },
+        {NULL, 0, 0},
+        {NULL, 0, 0}
+};
+
+struct async_event_loop *async_edf_event_loop = &async_edf_loop_.base;
+
+#define async_edf_get_() ((async_edf_loop *) event_loop)
+
+static int async_edf_push_(async_edf_loop *loop, struct astate *state) {
+    struct astate **heap;
+    size_t i, parent;
+    if (!async_arr_push(&loop->heap, state)) return 0;
+    heap = loop->heap.data;
+    for (i = loop->heap.length - 1; i > 0 && heap[parent = (i - 1) / 2]->_deadline > state->_deadline; i = parent) {
+        heap[i] = heap[parent];
+    }
+    heap[i] = state;
+    return 1;
+}
+
+static struct astate *async_edf_pop_(async_edf_loop *loop) {
+    struct astate **heap = loop->heap.data;
+    struct astate *top = heap[0], *last = heap[--loop->heap.length];
+    size_t i = 0, child, n = loop->heap.length;
+    while ((child = 2 * i + 1) < n) {
+        if (child + 1 < n && heap[child + 1]->_deadline < heap[child]->_deadline) child++;
+        if (heap[child]->_deadline >= last->_deadline) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    if (n > 0) heap[i] = last;
+    return top;
+}
+
+/* Task with deadline can be resumed again in the same cycle, polling ones wait for the next cycle */
+#define async_edf_again_(state, now)                                                       \
+    ((state)->_deadline != 0 && !async_done(state) && !async_must_cancel_(state) &&        \
+     !((state)->_flags & _ASYNC_FLAG_POLLING) && async_ready_(state, now))
+
+/* Resume collected task unless something cancelled it since, returns 1 if it was resumed */
+static int async_edf_resume_(struct astate *state) {
+    if (async_done(state) || async_must_cancel_(state)) return 0;
+    async_disarm_(state);
+    async_resume_(state);
+    if (state->_deadline != 0 && state->_next != NULL && state->_next->_deadline == 0) {
+        state->_next->_deadline = state->_deadline; /* awaited child works towards the same deadline */
+    }
+    return 1;
+}
+
+/*
+ * Resume tasks with deadline earliest first. Task that is still runnable after its resume goes back to the heap
+ * together with the child it started awaiting, so it runs to its next suspension on a timer, child or condition
+ * before later deadlines do, within ASYNC_EDF_BUDGET extra resumes per cycle. Tasks without deadline and the
+ * late ones that aren't shed are resumed once after that.
+ */
+static int async_edf_tick_(async_edf_loop *loop, double *wakeup) {
+    ASYNC_LOOP_HEAD;
+    size_t runnable = 0, budget = ASYNC_EDF_BUDGET, i;
+    int progress = 0;
+    double now = loop->base.now = async_monotonic();
+
+    async_metrics_begin_();
+    *wakeup = 0;
+    loop->heap.length = 0;
+    loop->background.length = 0;
+    ASYNC_LOOP_BODY_BEGIN
+    ASYNC_LOOP_BLOCK_NOREFS
+    ASYNC_LOOP_RUNNER_BLOCK_CANCELLED
+    else if (async_done(state)) {
+        continue;
+    } else if (!async_ready_(state, now)) {
+        async_nearest_timer_(state, now, *wakeup)
+        continue;
+    } else if (state->_deadline != 0 ? !async_edf_push_(loop, state) : !async_arr_push(&loop->background, state)) {
+        runnable += async_edf_resume_(state); /* out of memory for the queues, resume in list order */
+    }
+    progress = 1;
+    ASYNC_LOOP_BODY_END;
+
+    while (loop->heap.length > 0) {
+        state = async_edf_pop_(loop);
+        if (state->_deadline < now) {
+            if (!(state->_flags & _ASYNC_FLAG_LATE)) {
+                state->_flags |= _ASYNC_FLAG_LATE;
+                loop->base.deadline_misses++;
+            }
+#ifndef ASYNC_NO_CANCEL
+            if (loop->base.shed_late) {
+                async_cancel(state);
+                continue;
+            }
+#endif
+            if (async_arr_push(&loop->background, state)) continue;
+        }
+        if (!async_edf_resume_(state)) continue;
+        runnable++;
+        next = state->_next;
+        if (budget > 0 && next != NULL && async_edf_again_(next, now) && async_edf_push_(loop, next)) {
+            budget--;
+        }
+        if (budget > 0 && async_edf_again_(state, now) && async_edf_push_(loop, state)) {
+            budget--;
+            runnable--; /* counted once more on its next resume */
+        }
+    }
+    for (i = 0; i < loop->background.length; i++) {
+        runnable += async_edf_resume_(loop->background.data[i]);
+    }
+    async_set_runnable_(&loop->base, runnable);
+    async_metrics_cycle_();
+    async_watch_cycle_();
+    return progress;
+}
+
+static void async_edf_init_(void) {
+    async_edf_loop *loop = async_edf_get_();
+    async_loop_init_();
+    loop->heap.length = 0;
+    loop->background.length = 0;
+}
+
+static void async_edf_destroy_(void) {
+    async_edf_loop *loop = async_edf_get_();
+    async_loop_destroy_();
+    async_arr_destroy(&loop->heap);
+    async_arr_destroy(&loop->background);
+}
+
+static void async_edf_run_forever_(void) {
+    async_edf_loop *loop = async_edf_get_();
+    double wakeup;
+    while (loop->base.tasks_head != NULL) {
+        if (!async_edf_tick_(loop, &wakeup)) {
+            async_loop_wait_(wakeup);
+        }
+    }
+    loop->base.now = 0;
+}
+
+static void async_edf_run_until_complete_(struct astate *main) {
+    async_edf_loop *loop = async_edf_get_();
+    double wakeup;
+    if (main == NULL) {
+        return;
+    }
+    loop->base.now = async_monotonic();
+    while (async_resume_(main) != ASYNC_DONE) {
+        if (!async_edf_tick_(loop, &wakeup) && !async_ready_(main, loop->base.now)) {
+            async_nearest_timer_(main, loop->base.now, wakeup)
+            async_loop_wait_(wakeup);
+        }
+    }
+    loop->base.now = 0;
+    if (async_unreferenced_(main)) {
+        STATE_FREE(main);
+    }
+}
+
+/* Unsigned LEB128 varints of the binary logs and checkpoints */
+static void async_write_varint_(FILE *f, unsigned long v) {
+    while (v >= 0x80) {
+        putc((int) ((v & 0x7f) | 0x80), f);
+        v >>= 7;
+    }
+    putc((int) v, f);
+}
+
+/* Returns 0 on end of file or value that doesn't fit 32 bits */
+static int async_read_varint_(FILE *f, unsigned long *v) {
+    unsigned int shift = 0;
+    int c;
+    *v = 0;
+    do {
+        c = getc(f);
+        if (c == EOF || shift > 28) return 0;
+        *v |= (unsigned long) (c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return 1;
+}
+
+/*
+ * Deterministic virtual time simulation loop.
+ * While it is the current event loop async_monotonic() returns the loop's virtual clock, which stands
+ * still while tasks run and jumps straight to the nearest timer once nothing is runnable. Every cycle
+ * runnable tasks are collected and resumed in an order shuffled by generator seeded with async_sim_seed,
+ * so the same seed and the same program reproduce the same interleaving. Tasks added during a cycle
+ * are resumed on the next one.
+ * Scheduling decisions can be recorded into a log and replayed in place of the generator: every cycle
+ * stores the clock, the number of runnable tasks and the Fisher-Yates swap picked for each of them.
+ * Replay checks the clock and the number against the log and stops as diverged on the first mismatch.
+ */
+typedef struct {
+    struct async_event_loop base;
+    double clock;
+    unsigned long seed;
+    unsigned long rng;
+    async_arr_t(struct astate *) runnable;
+    FILE *record;
+    FILE *replay;
+    int diverged; /* replay stopped because the program didn't follow the log */
+} async_sim_loop;
+
+static void async_sim_init_(void);
+
+static void async_sim_destroy_(void);
+
+static void async_sim_run_forever_(void);
+
+static void async_sim_run_until_complete_(struct astate *main);
+
+/* Virtual clock starts at 1 as 0 means "no timer" and "no cached time" to the rest of the library */
+#define ASYNC_SIM_EPOCH 1.0
+
+static async_sim_loop async_sim_loop_ = {
+        {
+                async_sim_init_,
+                async_sim_destroy_,
+                async_loop_add_task_,
+                async_loop_add_tasks_,
+                async_sim_run_forever_,
+                async_sim_run_until_complete_,
+                NULL,
+                NULL,
+                0,
+                0,
+                0,
+                0, 0,
+                0, 0,
+                0,
+                0,
+                0,
+                NULL
+        },
+        ASYNC_SIM_EPOCH,
+        1,
+        1,
+        {NULL, 0, 0},
+        NULL,
+        NULL,
+        0
+};
+
+struct async_event_loop *async_sim_event_loop = &async_sim_loop_.base;
+
+#define async_sim_get_() ((async_sim_loop *) event_loop)
+
+void async_sim_seed(unsigned long seed) {
+    async_sim_loop_.seed = seed;
+    async_sim_loop_.rng = seed != 0 ? seed : 1; /* xorshift never leaves 0 */
+}
+
+/* xorshift32, kept in unsigned long and masked so results don't depend on its width */
+static unsigned long async_sim_random_(async_sim_loop *loop) {
+    unsigned long x = loop->rng;
+    x ^= (x << 13) & 0xffffffffUL;
+    x ^= x >> 17;
+    x ^= (x << 5) & 0xffffffffUL;
+    return loop->rng = x & 0xffffffffUL;
+}
+
+/* Scheduling log is "A2SR", version byte, then per cycle: clock as native double, varint n, n - 1 varint swaps */
+static const char async_sim_log_magic_[5] = {'A', '2', 'S', 'R', 1};
+
+/* Stops replay as diverged, the loop carries on with its generator */
+static void async_sim_diverge_(async_sim_loop *loop) {
+    fclose(loop->replay);
+    loop->replay = NULL;
+    loop->diverged = 1;
+}
+
+/* Reads next varint of the replayed log, diverges unless it is below limit */
+static unsigned long async_sim_read_varint_(async_sim_loop *loop, unsigned long limit) {
+    unsigned long v;
+    if (!async_read_varint_(loop->replay, &v) || v >= limit) {
+        async_sim_diverge_(loop);
+        return 0;
+    }
+    return v;
+}
+
+/* Picks the swap for position i - 1 of the shuffle from the replayed log or the generator */
+static size_t async_sim_pick_(async_sim_loop *loop, size_t i) {
+    unsigned long j = 0;
+    if (loop->replay != NULL) {
+        j = async_sim_read_varint_(loop, (unsigned long) i);
+    }
+    if (loop->replay == NULL) {
+        j = async_sim_random_(loop) % i;
+    }
+    if (loop->record != NULL) {
+        async_write_varint_(loop->record, j);
+    }
+    return (size_t) j;
+}
+
+static int async_sim_tick_(async_sim_loop *loop, double *wakeup) {
+    ASYNC_LOOP_HEAD;
+    size_t runnable = 0, i, j;
+    int progress = 0;
+    double now = loop->base.now = loop->clock;
+
+    async_metrics_begin_();
+    if (loop->replay != NULL) {
+        if (fread(&now, sizeof(now), 1, loop->replay) != 1) {
+            fclose(loop->replay); /* whole log replayed */
+            loop->replay = NULL;
+        } else if (now != loop->clock) {
+            async_sim_diverge_(loop);
+        }
+        now = loop->clock;
+    }
+
+    *wakeup = 0;
+    loop->runnable.length = 0;
+    ASYNC_LOOP_BODY_BEGIN
+    ASYNC_LOOP_BLOCK_NOREFS
+    ASYNC_LOOP_RUNNER_BLOCK_CANCELLED
+    else if (async_done(state)) {
+        continue;
+    } else if (!async_ready_(state, now)) {
+        async_nearest_timer_(state, now, *wakeup)
+        continue;
+    } else if (!async_arr_push(&loop->runnable, state)) {
+        runnable += async_edf_resume_(state); /* out of memory for the shuffle, resume in list order */
+    }
+    progress = 1;
+    ASYNC_LOOP_BODY_END;
+
+    if (loop->replay != NULL && async_sim_read_varint_(loop, ULONG_MAX) != loop->runnable.length) {
+        if (loop->replay != NULL) async_sim_diverge_(loop);
+    }
+    if (loop->record != NULL) {
+        fwrite(&now, sizeof(now), 1, loop->record);
+        async_write_varint_(loop->record, (unsigned long) loop->runnable.length);
+    }
+    for (i = loop->runnable.length; i > 1; i--) {
+        j = async_sim_pick_(loop, i);
+        state = loop->runnable.data[i - 1];
+        loop->runnable.data[i - 1] = loop->runnable.data[j];
+        loop->runnable.data[j] = state;
+    }
+    for (i = 0; i < loop->runnable.length; i++) {
+        runnable += async_edf_resume_(loop->runnable.data[i]);
+    }
+    async_set_runnable_(&loop->base, runnable);
+    async_metrics_cycle_();
+    async_watch_cycle_();
+    return progress;
+}
+
+/* Advance virtual time after a cycle: by its cost if something ran, to the nearest timer otherwise */
+static void async_sim_advance_(async_sim_loop *loop, int progress, double wakeup) {
+    if (!progress && wakeup > loop->clock) {
+        loop->clock = wakeup;
+        loop->base.idle_wakeups++;
+    } else {
+        loop->clock += ASYNC_SIM_CYCLE;
+    }
+}
+
+async_error async_sim_record(const char *path) {
+    async_sim_loop *loop = &async_sim_loop_;
+    if (path == NULL) {
+        if (loop->record != NULL) fclose(loop->record);
+        loop->record = NULL;
+        return ASYNC_OK;
+    }
+    if (loop->record != NULL) return ASYNC_EINVAL_STATE;
+    loop->record = fopen(path, "wb");
+    if (loop->record == NULL) return ASYNC_ENOMEM;
+    fwrite(async_sim_log_magic_, sizeof(async_sim_log_magic_), 1, loop->record);
+    return ASYNC_OK;
+}
+
+async_error async_sim_replay(const char *path) {
+    async_sim_loop *loop = &async_sim_loop_;
+    char magic[sizeof(async_sim_log_magic_)];
+    async_error err = loop->diverged ? ASYNC_EINVAL_STATE : ASYNC_OK;
+    if (path == NULL) {
+        if (loop->replay != NULL) fclose(loop->replay);
+        loop->replay = NULL;
+        loop->diverged = 0;
+        return err;
+    }
+    if (loop->replay != NULL) return ASYNC_EINVAL_STATE;
+    loop->diverged = 0;
+    loop->replay = fopen(path, "rb");
+    if (loop->replay == NULL) return ASYNC_ENOMEM;
+    if (fread(magic, sizeof(magic), 1, loop->replay) != 1 || memcmp(magic, async_sim_log_magic_, sizeof(magic)) != 0) {
+        fclose(loop->replay);
+        loop->replay = NULL;
+        return ASYNC_EINVAL_STATE;
+    }
+    return ASYNC_OK;
+}
+
+static void async_sim_init_(void) {
+    async_sim_loop *loop = async_sim_get_();
+    async_loop_init_();
+    loop->clock = ASYNC_SIM_EPOCH;
+    loop->rng = loop->seed != 0 ? loop->seed : 1;
+    loop->runnable.length = 0;
+}
+
+static void async_sim_destroy_(void) {
+    async_sim_loop *loop = async_sim_get_();
+    async_loop_destroy_();
+    async_arr_destroy(&loop->runnable);
+}
+
+static void async_sim_run_forever_(void) {
+    async_sim_loop *loop = async_sim_get_();
+    double wakeup;
+    while (loop->base.tasks_head != NULL) {
+        async_sim_advance_(loop, async_sim_tick_(loop, &wakeup), wakeup);
+    }
+    loop->base.now = 0;
+}
+
+static void async_sim_run_until_complete_(struct astate *main) {
+    async_sim_loop *loop = async_sim_get_();
+    double wakeup;
+    int progress;
+    if (main == NULL) {
+        return;
+    }
+    loop->base.now = loop->clock;
+    while (async_resume_(main) != ASYNC_DONE) {
+        progress = async_sim_tick_(loop, &wakeup) || async_ready_(main, loop->base.now);
+        async_nearest_timer_(main, loop->base.now, wakeup)
+        async_sim_advance_(loop, progress, wakeup);
+        loop->base.now = loop->clock;
+    }
+    loop->base.now = 0;
+    if (async_unreferenced_(main)) {
+        STATE_FREE(main);
+    }
+}
+
+/* async_new of translation units the library is compiled into */
+static ASYNC_INLINE struct astate *async_new_state_(AsyncCallback child_f, void *args,
+                                                   size_t stack_size, size_t stack_offset) {
+    struct astate *state;
+    size_t padding;
+
+    padding = stack_offset - sizeof(*state);
+    state = async_arena_alloc_(sizeof(*state) + padding + stack_size);
+    if (state == NULL) {
+        state = calloc(1, sizeof(*state) + padding + stack_size);
+    }
+    if (state == NULL) return NULL;
+    state->locals = ((char *) state) + stack_offset;
+    state->args = args;
+    state->_func = child_f;
+#ifndef ASYNC_NO_REFCNT
+    state->_refcnt = 1; /* State has 1 reference set as function "owns" itself until exited or cancelled */
+#endif
+    async_n_states_++;
+    async_live_link_(state);
+    /* state->_async_k = ASYNC_INIT; state is already ASYNC_INIT because memory is zeroed */
+    return state;
+}
+
+struct astate *async_new_coro_(AsyncCallback child_f, void *args, size_t stack_size, size_t stack_offset) {
+    return async_new_state_(child_f, args, stack_size, stack_offset);
+}
+
+struct astate **async_new_coros_(size_t n, AsyncCallback child_f, void **args,
+                                 size_t stack_size, size_t stack_offset, size_t stack_align) {
+    struct async_block *block;
+    struct astate **states, *state;
+    char *member;
+    size_t i, align, prefix, stride, head;
+
+    if (n == 0) return NULL;
+    align = _ASYNC_COMPUTE_OFFSET(char, struct astate);
+    if (stack_align > align) align = stack_align;
+    /* Every member is [pointer to block, padding][astate, locals][padding] */
+    prefix = async_align_up_(sizeof(struct async_block *), align);
+    stride = async_align_up_(prefix + stack_offset + stack_size, align);
+    head = async_align_up_(sizeof(*block) + n * sizeof(*states), align);
+    block = calloc(1, head + n * stride);
+    if (block == NULL) return NULL;
+    block->live = n;
+    states = (struct astate **) (block + 1);
+    member = (char *) block + head;
+    for (i = 0; i < n; i++, member += stride) {
+        state = (struct astate *) (member + prefix);
+        async_block_of_(state) = block;
+        state->locals = ((char *) state) + stack_offset;
+        state->args = args ? args[i] : NULL;
+        state->_func = child_f;
+#ifndef ASYNC_NO_REFCNT
+        state->_refcnt = 1;
+#endif
+        state->_flags = _ASYNC_FLAG_BLOCK;
+        async_live_link_(state);
+        states[i] = state;
+    }
+    async_n_states_ += n;
+    return states;
+}
+
+void async_free_coro_(struct astate *state) {
+    if (state != NULL) {
+        STATE_FREE(state);
+    }
+}
+
+void async_free_coros_(size_t n, struct astate **states) {
+    while (n--) {
+        if (states[n]) STATE_FREE(states[n]);
+    }
+}
+
+static async async_yielder(struct astate *state) {
+    async_begin(state);
+            async_yield;
+    async_end;
+}
+
+typedef struct {
+    async_arr_t(struct astate *) arr_coros;
+} gathered_stack;
+
+#ifndef ASYNC_NO_CANCEL
+static void async_gatherer_cancel(struct astate *state) {
+    gathered_stack *locals = state->locals;
+    size_t i;
+    for (i = 0; i < locals->arr_coros.length; i++) {
+        ASYNC_DECREF(locals->arr_coros.data[i]);
+        async_cancel(locals->arr_coros.data[i]);
+    }
+}
+#endif
+
+static async async_gatherer(struct astate *state) {
+    gathered_stack *locals = state->locals;
+    size_t i;
+    struct astate *child;
+    async_begin(state);
+            while (1) {
+                for (i = 0; i < locals->arr_coros.length; i++) {
+                    child = locals->arr_coros.data[i];
+                    if (!async_done(child)) {
                         goto cont;
                     } else { /* Remove coroutine from the list of tracked coros */
                         ASYNC_DECREF(child);
@@ -358,183 +2424,1666 @@ static async async_gatherer(struct astate *state) {
     async_end;
 }
 
-struct astate *async_vgather(size_t n, ...) {
-    va_list v_args;
-    gathered_stack *stack;
-    struct astate *state;
-    size_t i;
+struct astate *async_vgather(size_t n, ...) {
+    va_list v_args;
+    gathered_stack *stack;
+    struct astate *state;
+    size_t i;
+
+    /* Array of children is stored in the locals right after the stack, so it's freed together with the state */
+    state = async_new_coro_(async_gatherer, NULL, sizeof(gathered_stack) + n * sizeof(struct astate *),
+                            _ASYNC_COMPUTE_OFFSET(struct astate, gathered_stack));
+    if (state == NULL) goto fail;
+    async_set_funcname_(state, "async_gatherer");
+#ifndef ASYNC_NO_CANCEL
+    async_set_on_cancel(state, async_gatherer_cancel);
+#endif
+
+    stack = state->locals;
+    stack->arr_coros.data = (struct astate **) (stack + 1);
+    stack->arr_coros.capacity = n;
+
+    va_start(v_args, n);
+    for (i = 0; i < n; i++) {
+        stack->arr_coros.data[i] = va_arg(v_args, struct astate *);
+    }
+    va_end(v_args);
+    stack->arr_coros.length = n;
+    if (!async_create_tasks(n, stack->arr_coros.data)) {
+        goto fail;
+    }
+    for (i = 0; i < n; i++) {
+        ASYNC_INCREF(stack->arr_coros.data[i]);
+        _ASYNC_SET_PARENT(stack->arr_coros.data[i], state);
+    }
+    return state;
+
+    fail:
+    if (state) {
+        STATE_FREE(state);
+    }
+    va_start(v_args, n);
+    for (i = 0; i < n; i++) {
+        state = va_arg(v_args, struct astate *);
+        if (state) STATE_FREE(state);
+    }
+    va_end(v_args);
+    return NULL;
+
+
+}
+
+
+struct astate *async_gather(size_t n, struct astate **states) {
+    struct astate *state;
+    gathered_stack *stack;
+    size_t i;
+
+    ASYNC_PREPARE_NOARGS(async_gatherer, state, gathered_stack, async_gatherer_cancel, fail);
+    async_set_funcname_(state, "async_gatherer");
+    stack = state->locals;
+    stack->arr_coros.capacity = n;
+    stack->arr_coros.length = n;
+    stack->arr_coros.data = states;
+    if (!async_create_tasks(n, states)) {
+        STATE_FREE(state);
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        ASYNC_INCREF(stack->arr_coros.data[i]);
+        _ASYNC_SET_PARENT(stack->arr_coros.data[i], state);
+    }
+    return state;
+    fail:
+    return NULL;
+}
+
+typedef struct {
+    double sec;
+    double slack;
+    double deadline; /* computed on the first run unless set by async_sleep_until */
+} sleeper_stack;
+
+
+static async async_sleeper(struct astate *state) {
+    sleeper_stack *locals = state->locals;
+    async_begin(state);
+            if (locals->deadline == 0) {
+                locals->deadline = async_timer_align_(async_now() + locals->sec, locals->slack);
+            }
+            await_while(async_park_(state, locals->deadline));
+    async_end;
+}
+
+struct astate *async_sleep_slack(double delay, double slack) {
+    struct astate *state;
+    sleeper_stack *stack;
+    if (delay == 0) {
+        ASYNC_PREPARE_NOARGS(async_yielder, state, ASYNC_NONE, NULL, fail);
+    } else {
+        ASYNC_PREPARE_NOARGS(async_sleeper, state, sleeper_stack, NULL, fail);
+        stack = state->locals; /* Yet another predefined locals trick for mere optimisation, use async_alloc_ in real adapter functions instead. */
+        stack->sec = delay;
+        stack->slack = slack;
+    }
+    return state;
+    fail:
+    return NULL;
+}
+
+struct astate *async_sleep(double delay) {
+    return async_sleep_slack(delay, event_loop->timer_slack);
+}
+
+struct astate *async_sleep_until(double deadline) {
+    struct astate *state;
+    sleeper_stack *stack;
+    ASYNC_PREPARE_NOARGS(async_sleeper, state, sleeper_stack, NULL, fail);
+    stack = state->locals;
+    stack->deadline = deadline;
+    return state;
+    fail:
+    return NULL;
+}
+
+struct async_interval async_interval(double period) {
+    struct async_interval interval;
+    interval.period = period;
+    interval.next = period > 0 ? 0 : -1; /* also rejects NaN */
+    interval.missed = 0;
+    return interval;
+}
+
+int async_interval_wait_(struct astate *state, struct async_interval *interval) {
+    double now = async_now();
+    double n;
+    if (interval->next < 0) return 0; /* invalid period, await_tick exits with an error */
+    if (interval->next == 0) { /* first tick is the next multiple of period */
+        interval->next = async_timer_align_(now, interval->period);
+        if (interval->next <= now) interval->next += interval->period;
+    }
+    if (now < interval->next) {
+        state->_wakeup = interval->next;
+        return 1;
+    }
+    /* Fire once for the overdue tick and skip the rest, schedule stays on multiples of period */
+    n = (now - interval->next) / interval->period;
+    n = (n < (double) ULONG_MAX) ? (double) (unsigned long) n : 0;
+    interval->missed += (unsigned long) n;
+    interval->next += (n + 1) * interval->period;
+    return 0;
+}
+
+typedef struct {
+    double sec;
+    double deadline;
+} waiter_stack;
+
+#ifndef ASYNC_NO_CANCEL
+static void async_waiter_cancel(struct astate *state) {
+    struct astate *child = state->args;
+    if (child == NULL) return;
+    state->args = NULL;
+    if (state->_next == child) { /* already scheduled and awaited, the loop mustn't release it once more */
+        state->_next = NULL;
+    } else if (!async_create_task(child)) {
+        return;
+    }
+    if (!async_done(child)) {
+        async_cancel(child);
+    }
+    ASYNC_DECREF(child);
+}
+
+static async async_waiter(struct astate *state) {
+    waiter_stack *locals = state->locals;
+    struct astate *child = state->args;
+    async_begin(state);
+            if (!async_create_task(child)) {
+                state->args = NULL;
+                async_errno = ASYNC_ENOMEM;
+                async_exit;
+            }
+            locals->deadline = async_timer_align_(async_now() + locals->sec, event_loop->timer_slack);
+            state->_next = child; /* let the loop resume us once child is done or timeout is reached */
+            await_while(!async_done(child) && async_park_(state, locals->deadline));
+            state->_next = NULL;
+            if (!async_done(child)) {
+                async_errno = ASYNC_ECANCELED;
+                async_cancel(child);
+            }
+            ASYNC_DECREF(child);
+    async_end;
+}
+
+struct astate *async_wait_for(struct astate *child, double timeout) {
+    struct astate *state;
+    waiter_stack *stack;
+    if (child == NULL) { return NULL; }
+    ASYNC_PREPARE_NOARGS(async_waiter, state, waiter_stack, async_waiter_cancel, fail);
+    async_set_funcname_(state, "async_waiter");
+    stack = state->locals; /* Predefine locals. This trick can be used to create friendly methods. */
+    state->args = child;
+    stack->sec = timeout;
+    ASYNC_INCREF(child);
+    _ASYNC_SET_PARENT(child, state);
+    return state;
+    fail:
+    STATE_FREE(child);
+    return NULL;
+}
+#endif
+
+#ifndef ASYNC_NO_ALLOCS
+void *async_alloc_(struct astate *state, size_t size) {
+    void *mem;
+    if (state == NULL) { return NULL; }
+    mem = malloc(size);
+    if (mem == NULL) { return NULL; }
+    if (!async_arr_push(&state->_allocs, mem)) {
+        free(mem);
+        return NULL;
+    }
+    return mem;
+}
+
+int async_free_(struct astate *state, void *mem) {
+    size_t i;
+    void *obj;
+
+    i = state->_allocs.length;
+    while (i--) {
+        obj = state->_allocs.data[i];
+        if (obj == mem) {
+            free(obj);
+            async_arr_splice(&state->_allocs, i, 1);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int async_free_later_(struct astate *state, void *mem) {
+    if (mem == NULL || !async_arr_push(&state->_allocs, mem)) return 0;
+    return 1;
+}
+#endif
+
+double async_monotonic(void) {
+    static double origin = -1;
+    double now;
+    if (event_loop == &async_sim_loop_.base) {
+        return async_sim_loop_.clock;
+    }
+    now = async_os_clock_();
+    if (origin < 0) {
+        origin = now - ASYNC_SIM_EPOCH; /* keep values small, so timer alignment doesn't overflow, but never 0 */
+    }
+    return now - origin;
+}
+
+double async_now(void) {
+    return event_loop->now != 0 ? event_loop->now : async_monotonic();
+}
+
+#ifdef ASYNC_PROFILE
+struct async_sample_ {
+    unsigned int depth;
+    const char *names[ASYNC_PROFILE_DEPTH]; /* innermost frame first */
+    unsigned int lines[ASYNC_PROFILE_DEPTH];
+};
+
+/*
+ * Samples are only written by the signal handler, which publishes each one by bumping n after filling it.
+ * Readers block the signal, so neither side ever waits for the other.
+ */
+static struct {
+    struct async_sample_ samples[ASYNC_PROFILE_SAMPLES];
+    volatile size_t n;
+    volatile unsigned long dropped;
+    int running;
+#ifdef ASYNC_PROFILE_
+    struct sigaction old_action;
+#endif
+} async_profile_;
+
+static const char async_profile_loop_[] = "[event loop]", async_profile_idle_[] = "[no event loop]";
+
+#ifdef ASYNC_PROFILE_
+static void async_profile_handler_(int sig) {
+    struct astate *state = async_running_;
+    struct async_sample_ *sample;
+    size_t n = async_profile_.n;
+    unsigned int depth = 0, i;
+
+    (void) sig;
+    if (n == ASYNC_PROFILE_SAMPLES) {
+        async_profile_.dropped++;
+        return;
+    }
+    sample = &async_profile_.samples[n];
+    if (state == NULL) {
+        sample->lines[depth] = 0;
+        sample->names[depth++] = event_loop->now != 0 ? async_profile_loop_ : async_profile_idle_;
+    }
+    if (state != NULL) { /* pinned while its function runs, its parents are copied from the recorded chain */
+        sample->names[depth] = state->_funcname ? state->_funcname : "?";
+        sample->lines[depth++] = state->_async_k;
+        for (i = 0; async_profile_chain_.owner == state && i < async_profile_chain_.depth; i++) {
+            sample->names[depth] = async_profile_chain_.names[i];
+            sample->lines[depth++] = async_profile_chain_.lines[i];
+        }
+    }
+    sample->depth = depth;
+    async_profile_.n = n + 1;
+}
+#endif
+
+async_error async_profile_start(double interval) {
+#ifdef ASYNC_PROFILE_
+    struct sigaction action;
+    struct itimerval timer;
+
+    if (async_profile_.running) return ASYNC_EINVAL_STATE;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = async_profile_handler_;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, &async_profile_.old_action) != 0) return ASYNC_ENOMEM;
+    timer.it_interval.tv_sec = (long) interval;
+    timer.it_interval.tv_usec = (long) ((interval - (double) (long) interval) * 1e6);
+    if (timer.it_interval.tv_sec == 0 && timer.it_interval.tv_usec == 0) {
+        timer.it_interval.tv_usec = 1; /* zero would disarm the timer */
+    }
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        sigaction(SIGPROF, &async_profile_.old_action, NULL);
+        return ASYNC_ENOMEM;
+    }
+    async_profile_.running = 1;
+    async_profile_chain_.on = 1;
+    return ASYNC_OK;
+#else
+    (void) interval;
+    return ASYNC_ENOMEM;
+#endif
+}
+
+void async_profile_stop(void) {
+#ifdef ASYNC_PROFILE_
+    struct itimerval timer;
+
+    if (!async_profile_.running) return;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    sigaction(SIGPROF, &async_profile_.old_action, NULL);
+    async_profile_.running = 0;
+    async_profile_chain_.on = 0;
+#endif
+}
+
+/* Orders samples by their frames from the outermost one, so equal stacks end up next to each other */
+static int async_profile_cmp_(const void *a, const void *b) {
+    const struct async_sample_ *x = a, *y = b;
+    unsigned int i, j;
+    int diff;
+
+    for (i = x->depth, j = y->depth; i > 0 && j > 0; i--, j--) {
+        diff = strcmp(x->names[i - 1], y->names[j - 1]);
+        if (diff != 0) return diff;
+        if (x->lines[i - 1] != y->lines[j - 1]) return x->lines[i - 1] < y->lines[j - 1] ? -1 : 1;
+    }
+    return (i > 0) - (j > 0);
+}
+
+size_t async_profile_dump(FILE *f) {
+    struct async_sample_ *samples = async_profile_.samples;
+    const char *name;
+    size_t n, i, count;
+    unsigned int j;
+#ifdef ASYNC_PROFILE_
+    sigset_t mask, old_mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGPROF);
+    sigprocmask(SIG_BLOCK, &mask, &old_mask);
+#endif
+    n = async_profile_.n;
+    qsort(samples, n, sizeof(*samples), async_profile_cmp_);
+    for (i = 0; i < n; i += count) {
+        for (count = 1; i + count < n && async_profile_cmp_(&samples[i], &samples[i + count]) == 0; count++) {}
+        for (j = samples[i].depth; j > 0; j--) {
+            name = samples[i].names[j - 1];
+            fputs(j < samples[i].depth ? ";" : "", f);
+            if (name == async_profile_loop_ || name == async_profile_idle_) {
+                fputs(name, f);
+            } else {
+                fprintf(f, "%s:%u", name, samples[i].lines[j - 1]);
+            }
+        }
+        fprintf(f, " %lu\n", (unsigned long) count);
+    }
+    if (async_profile_.dropped != 0) {
+        fprintf(f, "[dropped] %lu\n", async_profile_.dropped);
+    }
+    async_profile_.n = 0;
+    async_profile_.dropped = 0;
+#ifdef ASYNC_PROFILE_
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+#endif
+    return n;
+}
+
+/* Finished task, parent is 0 for top-level tasks */
+struct async_span_ {
+    size_t id, parent;
+    const char *name;
+    double start, end;
+};
+
+/* Time a function spent on the critical path of one tree */
+struct async_credit_ {
+    const char *name;
+    double sec;
+};
+
+typedef async_arr_t(struct async_credit_) async_credits_;
+
+static struct {
+    async_arr_t(struct async_span_) spans;
+    size_t last_id;
+    unsigned long dropped;
+} async_critpath_;
+
+static void async_critpath_spawned_(struct astate *state) {
+    if (state->_span_id != 0 || async_done(state)) return;
+    state->_span_id = ++async_critpath_.last_id;
+    state->_spawned = async_monotonic();
+}
+
+static void async_critpath_done_(struct astate *state) {
+    struct async_span_ span;
+    if (state->_span_id == 0) return;
+    span.id = state->_span_id;
+    span.parent = state->_parent != NULL ? state->_parent->_span_id : 0;
+    span.name = state->_funcname ? state->_funcname : "?";
+    span.start = state->_spawned;
+    span.end = async_monotonic();
+    if (!async_arr_push(&async_critpath_.spans, span)) {
+        async_critpath_.dropped++;
+    }
+    state->_span_id = 0;
+}
+
+void async_critpath_start(void) {
+    async_critpath_on_ = 1;
+}
+
+void async_critpath_stop(void) {
+    async_critpath_on_ = 0;
+}
+
+/* Children of a span are contiguous and ordered from the last one to finish */
+static int async_span_cmp_(const void *a, const void *b) {
+    const struct async_span_ *x = a, *y = b;
+    if (x->parent != y->parent) return x->parent < y->parent ? -1 : 1;
+    if (x->end != y->end) return x->end > y->end ? -1 : 1;
+    return 0;
+}
+
+static int async_credit_cmp_(const void *a, const void *b) {
+    const struct async_credit_ *x = a, *y = b;
+    return strcmp(x->name, y->name);
+}
+
+static int async_credit_sec_cmp_(const void *a, const void *b) {
+    const struct async_credit_ *x = a, *y = b;
+    if (x->sec != y->sec) return x->sec > y->sec ? -1 : 1;
+    return 0;
+}
+
+/* Index of the first span with given parent, n if there's none */
+static size_t async_span_children_(const struct async_span_ *spans, size_t n, size_t parent) {
+    size_t lo = 0, hi = n, mid;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (spans[mid].parent < parent) lo = mid + 1; else hi = mid;
+    }
+    return (lo < n && spans[lo].parent == parent) ? lo : n;
+}
+
+/*
+ * Credits [from, until] of the span's lifetime walking backwards: the child finished last before the current point
+ * released the span, so the path continues through it back to its start, time between children is span's own.
+ */
+static void async_critpath_walk_(const struct async_span_ *spans, size_t n, size_t i, double from, double until,
+                                 async_credits_ *credits) {
+    const struct async_span_ *span = &spans[i];
+    struct async_credit_ credit;
+    size_t child;
+    double t = until;
+
+    if (span->start > from) from = span->start;
+    credit.name = span->name;
+    for (child = async_span_children_(spans, n, span->id); child < n && spans[child].parent == span->id; child++) {
+        if (spans[child].end > t) continue;
+        if (spans[child].end <= from) break;
+        credit.sec = t - spans[child].end;
+        if (credit.sec > 0) async_arr_push(credits, credit);
+        async_critpath_walk_(spans, n, child, from, spans[child].end, credits);
+        t = spans[child].start > from ? spans[child].start : from;
+    }
+    credit.sec = t - from;
+    if (credit.sec > 0) async_arr_push(credits, credit);
+}
+
+size_t async_critpath_dump(FILE *f) {
+    struct async_span_ *spans = async_critpath_.spans.data;
+    size_t n = async_critpath_.spans.length, n_trees = 0, i, j;
+    async_credits_ credits;
+    double total = 0;
+
+    async_arr_init(&credits);
+    if (n > 0) qsort(spans, n, sizeof(*spans), async_span_cmp_);
+    for (i = 0; i < n && spans[i].parent == 0; i++, n_trees++) {
+        total += spans[i].end - spans[i].start;
+        async_critpath_walk_(spans, n, i, spans[i].start, spans[i].end, &credits);
+    }
+    /* Merge credits of every function, then order them by time */
+    if (credits.length > 0) qsort(credits.data, credits.length, sizeof(*credits.data), async_credit_cmp_);
+    for (i = 0, j = 0; i < credits.length; i++) {
+        if (j > 0 && strcmp(credits.data[j - 1].name, credits.data[i].name) == 0) {
+            credits.data[j - 1].sec += credits.data[i].sec;
+        } else {
+            credits.data[j++] = credits.data[i];
+        }
+    }
+    credits.length = j;
+    if (j > 0) qsort(credits.data, credits.length, sizeof(*credits.data), async_credit_sec_cmp_);
+    fprintf(f, "critical path of %lu task trees, %.3f ms end-to-end\n", (unsigned long) n_trees, total * 1e3);
+    for (i = 0; i < credits.length; i++) {
+        fprintf(f, "%12.3f ms %6.1f %%  %s\n", credits.data[i].sec * 1e3,
+                total > 0 ? 100 * credits.data[i].sec / total : 0.0, credits.data[i].name);
+    }
+    if (async_critpath_.dropped != 0) {
+        fprintf(f, "%lu tasks weren't recorded, out of memory\n", async_critpath_.dropped);
+    }
+    async_arr_destroy(&credits);
+    async_arr_destroy(&async_critpath_.spans);
+    async_critpath_.dropped = 0;
+    return n_trees;
+}
+#endif
+
+#if defined(__GNUC__)
+    #define async_barrier_() __sync_synchronize()
+#elif defined(_MSC_VER)
+    #define async_barrier_() _ReadWriteBarrier()
+#else
+    #define async_barrier_() (void) 0
+#endif
+
+static struct {
+    double since; /* start of the current resumes_per_sec window */
+    unsigned long resumes; /* resumes at its start */
+} async_metrics_window_;
+
+/* Seqlock writer, the loop is the only one */
+static void async_metrics_publish_(void) {
+    struct async_metrics *m = async_metrics_;
+    double end = async_monotonic(), us = (async_os_clock_() - async_metrics_started_) * 1e6;
+    unsigned int bucket;
+
+    for (bucket = 0; bucket + 1 < ASYNC_METRICS_BUCKETS && us >= (double) (1UL << bucket); bucket++) {}
+    m->seq++;
+    async_barrier_();
+    m->updated = end;
+    m->cycles++;
+    m->resumes += (unsigned long) event_loop->n_runnable;
+    if (end - async_metrics_window_.since >= 1) {
+        m->resumes_per_sec = (double) (m->resumes - async_metrics_window_.resumes) / (end - async_metrics_window_.since);
+        async_metrics_window_.since = end;
+        async_metrics_window_.resumes = m->resumes;
+    }
+    m->tasks_live = (unsigned long) event_loop->n_tasks;
+    m->tasks_runnable = (unsigned long) event_loop->n_runnable;
+    m->states_live = (unsigned long) async_n_states_;
+    m->arena_bytes = (unsigned long) (async_arena_.carved - async_arena_.n_released * ASYNC_ARENA_SLAB);
+    m->idle_wakeups = event_loop->idle_wakeups;
+    m->rejected_tasks = event_loop->rejected_tasks;
+    m->deadline_misses = event_loop->deadline_misses;
+    m->timers_armed = async_metrics_armed_;
+    m->timer_expiries = async_metrics_expiries_;
+    m->cycle_us[bucket]++;
+    m->magic = ASYNC_METRICS_MAGIC;
+    async_barrier_();
+    m->seq++;
+}
+
+async_error async_metrics_open(const char *path) {
+#ifdef ASYNC_METRICS_
+    void *mem;
+    int fd;
+
+    if (async_metrics_ != NULL) return ASYNC_EINVAL_STATE;
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return ASYNC_ENOMEM;
+    if (ftruncate(fd, (off_t) sizeof(struct async_metrics)) != 0) {
+        close(fd);
+        return ASYNC_ENOMEM;
+    }
+    mem = mmap(NULL, sizeof(struct async_metrics), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) return ASYNC_ENOMEM;
+    async_metrics_window_.since = async_monotonic();
+    async_metrics_window_.resumes = 0;
+    async_metrics_expiries_ = 0;
+    async_metrics_ = mem; /* zeroed by ftruncate */
+    return ASYNC_OK;
+#else
+    (void) path;
+    return ASYNC_ENOMEM;
+#endif
+}
+
+void async_metrics_close(void) {
+#ifdef ASYNC_METRICS_
+    if (async_metrics_ == NULL) return;
+    munmap((void *) async_metrics_, sizeof(struct async_metrics));
+    async_metrics_ = NULL;
+#endif
+}
+
+async_error async_metrics_snapshot(const struct async_metrics *shared, struct async_metrics *copy) {
+    unsigned long seq;
+    int attempt;
+
+    for (attempt = 0; attempt < 64; attempt++) {
+        seq = shared->seq;
+        async_barrier_();
+        memcpy(copy, (const void *) shared, sizeof(*copy));
+        async_barrier_();
+        if (!(seq & 1) && seq == shared->seq) {
+            return copy->magic == ASYNC_METRICS_MAGIC ? ASYNC_OK : ASYNC_EINVAL_STATE;
+        }
+    }
+    return ASYNC_EAGAIN;
+}
+
+/*
+ * Write-ahead log. Appends copy records into the batch being collected, the writer task lets the rest of the
+ * cycle's appends join it with one yield, then hands the whole batch to the log's flusher thread, which writes
+ * and syncs it once while the loop keeps running. The writer polls the flusher for completion, appenders poll
+ * durable against the sequence number of their record. Appends made meanwhile collect into the next batch.
+ */
+typedef struct {
+    unsigned long seq;
+} wal_appender_stack;
+
+#ifdef ASYNC_WAL_
+struct async_wal_flusher_ {
+    pthread_t thread;
+    pthread_mutex_t lock; /* guards pending, stop and err, flight belongs to the thread while pending is set */
+    pthread_cond_t wake;
+    async_arr_t(char) flight; /* batch being written */
+    unsigned long seq; /* wal->appended when the batch was handed over, loop side only */
+    int in_flight; /* batch was handed over and its result not applied yet, loop side only */
+    int pending, stop;
+    async_error err; /* of the last batch written */
+};
+
+/* Write and sync data to fd, runs on the flusher thread */
+static async_error async_wal_write_(int fd, const char *p, size_t left) {
+    ssize_t n;
+    while (left > 0) {
+        n = write(fd, p, left);
+        if (n < 0) {
+            if (errno != EINTR) return ASYNC_EIO;
+            continue;
+        }
+        p += n;
+        left -= (size_t) n;
+    }
+    /* A failed sync may have lost pages already, nothing appended after can be trusted either */
+    return fdatasync(fd) == 0 ? ASYNC_OK : ASYNC_EIO;
+}
+
+static void *async_wal_flusher_main_(void *arg) {
+    struct async_wal *wal = arg;
+    struct async_wal_flusher_ *flusher = wal->_flusher;
+    async_error err;
+    pthread_mutex_lock(&flusher->lock);
+    for (;;) {
+        while (!flusher->pending && !flusher->stop) {
+            pthread_cond_wait(&flusher->wake, &flusher->lock);
+        }
+        if (!flusher->pending) break;
+        pthread_mutex_unlock(&flusher->lock);
+        err = async_wal_write_(wal->_fd, flusher->flight.data, flusher->flight.length);
+        pthread_mutex_lock(&flusher->lock);
+        flusher->err = err;
+        flusher->pending = 0;
+    }
+    pthread_mutex_unlock(&flusher->lock);
+    return NULL;
+}
+
+/* Hand the collected batch over to the flusher, the flight buffer of the previous one is reused for collecting */
+static void async_wal_submit_(struct async_wal *wal) {
+    struct async_wal_flusher_ *flusher = wal->_flusher;
+    char *data = flusher->flight.data;
+    size_t capacity = flusher->flight.capacity;
+    flusher->flight.data = wal->_batch.data;
+    flusher->flight.length = wal->_batch.length;
+    flusher->flight.capacity = wal->_batch.capacity;
+    wal->_batch.data = data;
+    wal->_batch.length = 0;
+    wal->_batch.capacity = capacity;
+    flusher->seq = wal->appended;
+    flusher->in_flight = 1;
+    pthread_mutex_lock(&flusher->lock);
+    flusher->pending = 1;
+    pthread_cond_signal(&flusher->wake);
+    pthread_mutex_unlock(&flusher->lock);
+}
+
+/* Returns 1 and parks state while the batch handed over is still being written, applies its result once it's done */
+static int async_wal_flushing_(struct astate *state, struct async_wal *wal) {
+    struct async_wal_flusher_ *flusher = wal->_flusher;
+    int pending;
+    if (!flusher->in_flight) return 0;
+    pthread_mutex_lock(&flusher->lock);
+    pending = flusher->pending;
+    pthread_mutex_unlock(&flusher->lock);
+    if (pending) {
+        state->_wakeup = async_now() + ASYNC_WAL_POLL;
+        return 1;
+    }
+    flusher->in_flight = 0;
+    if (flusher->err != ASYNC_OK) {
+        if (wal->err == ASYNC_OK) wal->err = flusher->err;
+    } else if (wal->err == ASYNC_OK) {
+        wal->durable = flusher->seq;
+    }
+    wal->batches++;
+    return 0;
+}
+#endif
+
+static async async_wal_writer(struct astate *state) {
+    struct async_wal *wal = state->args;
+    async_begin(state);
+            while (wal->_batch.length > 0 && wal->err == ASYNC_OK) {
+                async_yield;
+#ifdef ASYNC_WAL_
+                await_while(async_wal_flushing_(state, wal)); /* batch left behind by a cancelled writer */
+                async_wal_submit_(wal);
+                await_while(async_wal_flushing_(state, wal));
+#endif
+            }
+            wal->_writer = NULL;
+    async_end;
+}
+
+#ifndef ASYNC_NO_CANCEL
+static void async_wal_writer_cancel(struct astate *state) {
+    struct async_wal *wal = state->args;
+    wal->_writer = NULL;
+    if (wal->err == ASYNC_OK && wal->durable != wal->appended) {
+        wal->err = ASYNC_ECANCELED; /* collected records were never written */
+    }
+}
+#endif
+
+#ifndef ASYNC_NO_CANCEL
+static void async_wal_appender_cancel(struct astate *state) {
+    struct async_wal *wal = state->args;
+    wal->_appenders--;
+}
+#endif
+
+/* Record isn't durable yet, appender checks again in ASYNC_WAL_POLL so an idle loop sleeps meanwhile */
+static int async_wal_waiting_(struct astate *state, struct async_wal *wal, unsigned long seq) {
+    if (wal->durable >= seq || wal->err != ASYNC_OK) return 0;
+#ifdef ASYNC_WAL_
+    state->_wakeup = async_now() + ASYNC_WAL_POLL;
+#else
+    (void) state;
+#endif
+    return 1;
+}
+
+static async async_wal_appender(struct astate *state) {
+    wal_appender_stack *locals = state->locals;
+    struct async_wal *wal = state->args;
+    async_begin(state);
+            await_while(async_wal_waiting_(state, wal, locals->seq));
+            if (wal->durable < locals->seq) {
+                async_errno = wal->err;
+            }
+            wal->_appenders--;
+    async_end;
+}
+
+struct async_wal *async_wal_open(const char *path) {
+#ifdef ASYNC_WAL_
+    struct async_wal *wal = calloc(1, sizeof(*wal));
+    struct async_wal_flusher_ *flusher = calloc(1, sizeof(*flusher));
+    sigset_t mask, old_mask;
+    int started;
+    if (wal == NULL || flusher == NULL) goto fail;
+    wal->_flusher = flusher;
+    if (pthread_mutex_init(&flusher->lock, NULL) != 0) goto fail;
+    if (pthread_cond_init(&flusher->wake, NULL) != 0) goto fail_lock;
+    wal->_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (wal->_fd < 0) goto fail_wake;
+    /* Flusher inherits a fully blocked mask, so signals like the profiler's SIGPROF only hit the loop thread */
+    sigfillset(&mask);
+    pthread_sigmask(SIG_SETMASK, &mask, &old_mask);
+    started = pthread_create(&flusher->thread, NULL, async_wal_flusher_main_, wal) == 0;
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (!started) goto fail_fd;
+    return wal;
+    fail_fd:
+    close(wal->_fd);
+    fail_wake:
+    pthread_cond_destroy(&flusher->wake);
+    fail_lock:
+    pthread_mutex_destroy(&flusher->lock);
+    fail:
+    free(flusher);
+    free(wal);
+    return NULL;
+#else
+    (void) path;
+    return NULL;
+#endif
+}
+
+struct astate *async_wal_append(struct async_wal *wal, const void *data, size_t size) {
+    struct astate *state;
+    wal_appender_stack *stack;
+    size_t length = wal->_batch.length;
+    ASYNC_PREPARE_NOARGS(async_wal_appender, state, wal_appender_stack, async_wal_appender_cancel, fail);
+    async_set_funcname_(state, "async_wal_appender");
+    state->args = wal;
+    wal->_appenders++;
+    stack = state->locals;
+    stack->seq = wal->appended + 1;
+    if (wal->err != ASYNC_OK) {
+        return state; /* finishes with the error on the first resume */
+    }
+    if (!async_arr_reserve(&wal->_batch, size)) goto fail_state;
+    if (wal->_writer == NULL) {
+        ASYNC_PREPARE_NOARGS(async_wal_writer, wal->_writer, ASYNC_NONE, async_wal_writer_cancel, fail_state);
+        async_set_funcname_(wal->_writer, "async_wal_writer");
+        wal->_writer->args = wal;
+        if (!async_create_task(wal->_writer)) { /* frees the writer */
+            wal->_writer = NULL;
+            goto fail_state;
+        }
+    }
+    memcpy(wal->_batch.data + length, data, size);
+    wal->_batch.length += size;
+    wal->appended++;
+    return state;
+    fail_state:
+    wal->_appenders--;
+    STATE_FREE(state);
+    fail:
+    return NULL;
+}
+
+async_error async_wal_close(struct async_wal *wal) {
+    async_error err = ASYNC_OK;
+    if (wal->_writer != NULL || wal->_appenders != 0) return ASYNC_EINVAL_STATE;
+#ifdef ASYNC_WAL_
+    {
+        struct async_wal_flusher_ *flusher = wal->_flusher;
+        pthread_mutex_lock(&flusher->lock);
+        flusher->stop = 1; /* a batch left by a cancelled writer is finished first */
+        pthread_cond_signal(&flusher->wake);
+        pthread_mutex_unlock(&flusher->lock);
+        pthread_join(flusher->thread, NULL);
+        pthread_cond_destroy(&flusher->wake);
+        pthread_mutex_destroy(&flusher->lock);
+        async_arr_destroy(&flusher->flight);
+        free(flusher);
+    }
+    if (close(wal->_fd) != 0) err = ASYNC_EIO;
+#endif
+    async_arr_destroy(&wal->_batch);
+    free(wal);
+    return err;
+}
 
-    ASYNC_PREPARE_NOARGS(async_gatherer, state, gathered_stack, async_gatherer_cancel, fail);
+/*
+ * Chunked file reader. The whole file is mapped once, MADV_WILLNEED starts kernel readahead of the chunks
+ * ahead of the cursor without blocking, mincore tells when the next chunk is resident and the chunk behind
+ * the cursor is dropped from the mapping and the page cache.
+ */
+struct async_file_chunks async_file_chunks(const char *path, size_t chunk_size) {
+    struct async_file_chunks chunks;
+    memset(&chunks, 0, sizeof(chunks));
+#ifdef ASYNC_CHUNKS_
+    {
+        size_t page = (size_t) sysconf(_SC_PAGESIZE);
+        struct stat st;
+        chunks._fd = open(path, O_RDONLY);
+        if (chunks._fd < 0 || fstat(chunks._fd, &st) != 0) {
+            chunks.err = ASYNC_EIO;
+            goto fail;
+        }
+        chunks._chunk = async_align_up_(chunk_size ? chunk_size : 1, page); /* madvise works on whole pages */
+        chunks._length = (size_t) st.st_size;
+        if (chunks._length == 0) return chunks;
+        chunks._map = mmap(NULL, chunks._length, PROT_READ, MAP_PRIVATE, chunks._fd, 0);
+        chunks._vec = malloc(chunks._chunk / page);
+        if (chunks._map == MAP_FAILED || chunks._vec == NULL) {
+            if (chunks._map == MAP_FAILED) chunks._map = NULL;
+            async_file_chunks_close(&chunks);
+            chunks.err = ASYNC_ENOMEM;
+            return chunks;
+        }
+#ifdef MADV_SEQUENTIAL
+        madvise(chunks._map, chunks._length, MADV_SEQUENTIAL);
+#endif
+        return chunks;
+    }
+    fail:
+    if (chunks._fd >= 0) close(chunks._fd);
+    chunks._fd = -1;
+    return chunks;
+#else
+    (void) path;
+    (void) chunk_size;
+    chunks.err = ASYNC_ENOMEM;
+    return chunks;
+#endif
+}
 
-    stack = state->locals;
-    async_arr_init(&stack->arr_coros);
-    if (!async_arr_reserve(&stack->arr_coros, n) || !async_free_later_(state, stack->arr_coros.data)) {
-        goto fail;
+#ifdef ASYNC_CHUNKS_
+/* Length of the chunk at offset, the last one may be short */
+#define async_chunk_length_(chunks, offset) \
+    ((chunks)->_length - (offset) < (chunks)->_chunk ? (chunks)->_length - (offset) : (chunks)->_chunk)
+
+/* All pages of the chunk at offset are in memory, mapping offset is page aligned as chunks are */
+static int async_chunk_resident_(struct async_file_chunks *chunks, size_t offset) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE), length = async_chunk_length_(chunks, offset), i;
+    if (mincore(chunks->_map + offset, length, (void *) chunks->_vec) != 0) return 1; /* can't tell, just read it */
+    for (i = 0; i < (length + page - 1) / page; i++) {
+        if (!(chunks->_vec[i] & 1)) return 0;
     }
+    return 1;
+}
+#endif
 
-    va_start(v_args, n);
-    for (i = 0; i < n; i++) {
-        stack->arr_coros.data[i] = va_arg(v_args, struct astate *);
+int async_file_chunks_wait_(struct astate *state, struct async_file_chunks *chunks) {
+#ifdef ASYNC_CHUNKS_
+    size_t offset;
+    if (!chunks->_waiting) {
+        if (chunks->data != NULL) { /* done with the current chunk, release it */
+            madvise(chunks->_map + chunks->offset, chunks->size, MADV_DONTNEED);
+#ifdef POSIX_FADV_DONTNEED
+            posix_fadvise(chunks->_fd, (off_t) chunks->offset, (off_t) chunks->size, POSIX_FADV_DONTNEED);
+#endif
+            chunks->_next = chunks->offset + chunks->size;
+        }
+        chunks->data = NULL;
+        chunks->size = 0;
+        if (chunks->err != ASYNC_OK || chunks->_next >= chunks->_length) return 0;
+        for (offset = chunks->_advised > chunks->_next ? chunks->_advised : chunks->_next;
+             offset < chunks->_length && offset <= chunks->_next + ASYNC_CHUNKS_AHEAD * chunks->_chunk;
+             offset += chunks->_chunk) {
+            madvise(chunks->_map + offset, async_chunk_length_(chunks, offset), MADV_WILLNEED);
+            chunks->_advised = offset + chunks->_chunk;
+        }
+        chunks->_waiting = 1;
+        chunks->_polls = 0;
     }
-    va_end(v_args);
-    stack->arr_coros.length = n;
-    if (!async_create_tasks(n, stack->arr_coros.data)) {
-        goto fail;
+    if (chunks->_polls < ASYNC_CHUNKS_POLLS && !async_chunk_resident_(chunks, chunks->_next)) {
+        chunks->_polls++;
+        chunks->waits++;
+        state->_wakeup = async_now() + 1e-4;
+        return 1;
     }
-    for (i = 0; i < n; i++) {
-        ASYNC_INCREF(stack->arr_coros.data[i]);
+    chunks->_waiting = 0;
+    chunks->offset = chunks->_next;
+    chunks->data = chunks->_map + chunks->offset;
+    chunks->size = async_chunk_length_(chunks, chunks->offset);
+    return 0;
+#else
+    (void) state;
+    chunks->data = NULL;
+    chunks->size = 0;
+    return 0;
+#endif
+}
+
+void async_file_chunks_close(struct async_file_chunks *chunks) {
+#ifdef ASYNC_CHUNKS_
+    if (chunks->_map != NULL) munmap(chunks->_map, chunks->_length);
+    if (chunks->_fd >= 0) close(chunks->_fd);
+#endif
+    free(chunks->_vec);
+    chunks->_map = NULL;
+    chunks->_vec = NULL;
+    chunks->_fd = -1;
+    chunks->data = NULL;
+    chunks->size = 0;
+}
+
+/*
+ * Path watches. Events read from the shared inotify descriptor are accumulated per watch descriptor until
+ * the watch's async_watcher takes them as one batch. Waiting watcher parks on a far timer that the dispatch
+ * moves to now, so it costs nothing until something changes. Watches of the same path share the slot,
+ * which is removed with the last of them.
+ */
+struct async_watch_slot_ {
+    int wd;
+    unsigned int refs; /* open watches sharing the slot */
+    unsigned int events;
+    unsigned long count;
+    struct astate *waiter;
+};
+
+typedef struct {
+    struct async_watch *watch;
+} watcher_stack;
+
+#ifdef ASYNC_WATCH_
+static async_arr_t(struct async_watch_slot_) async_watch_slots_ = {NULL, 0, 0};
+
+static struct async_watch_slot_ *async_watch_slot_(int wd) {
+    size_t i;
+    for (i = 0; i < async_watch_slots_.length; i++) {
+        if (async_watch_slots_.data[i].wd == wd) return &async_watch_slots_.data[i];
     }
-    return state;
+    return NULL;
+}
 
-    fail:
-    if (state) {
-        async_arr_destroy(&stack->arr_coros);
-        STATE_FREE(state);
+static void async_watch_dispatch_(void) {
+    char buf[4096];
+    const struct inotify_event *event;
+    struct async_watch_slot_ *slot;
+    ssize_t n, i;
+    async_watch_next_poll_ = event_loop->now + ASYNC_WATCH_POLL;
+    while ((n = read(async_inotify_fd_, buf, sizeof(buf))) > 0) {
+        for (i = 0; i < n; i += (ssize_t) (sizeof(*event) + event->len)) {
+            event = (const struct inotify_event *) (buf + i);
+            slot = async_watch_slot_(event->wd);
+            if (slot == NULL) continue;
+            slot->events |= event->mask;
+            slot->count++;
+            if (slot->waiter != NULL) {
+                slot->waiter->_wakeup = async_now(); /* due on the next cycle */
+                async_wake_(slot->waiter);
+            }
+        }
     }
-    va_start(v_args, n);
-    for (i = 0; i < n; i++) {
-        state = va_arg(v_args, struct astate *);
-        if (state) STATE_FREE(state);
+}
+
+static int async_watch_poll_(double sec) {
+    struct pollfd pfd;
+    if (async_inotify_fd_ < 0) return 0;
+    pfd.fd = async_inotify_fd_;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, sec < 1e6 ? (int) (sec * 1000) + 1 : 1000000000) > 0) {
+        event_loop->now = async_monotonic();
+        async_watch_dispatch_();
     }
-    va_end(v_args);
-    return NULL;
+    return 1;
+}
+#endif
 
+/*
+ * Takes the batch collected for the watch, parks the watcher while there is none.
+ * Fails the watcher with ASYNC_EINVAL_STATE if the watch is closed or another watcher of the path waits already.
+ */
+static int async_watch_take_(struct astate *state, struct async_watch *watch) {
+#ifdef ASYNC_WATCH_
+    struct async_watch_slot_ *slot = async_watch_slot_(watch->_wd);
+    if (slot == NULL || (slot->waiter != NULL && slot->waiter != state)) {
+        state->err = ASYNC_EINVAL_STATE;
+        return 0;
+    }
+    if (slot->count == 0) {
+        slot->waiter = state;
+        state->_wakeup = async_now() + ASYNC_WATCH_PARK;
+        return 1;
+    }
+    watch->events = slot->events;
+    watch->count = slot->count;
+    slot->events = 0;
+    slot->count = 0;
+    slot->waiter = NULL;
+#else
+    (void) state;
+    (void) watch;
+#endif
+    return 0;
+}
 
+#ifndef ASYNC_NO_CANCEL
+static void async_watcher_cancel(struct astate *state) {
+#ifdef ASYNC_WATCH_
+    watcher_stack *locals = state->locals;
+    struct async_watch_slot_ *slot = async_watch_slot_(locals->watch->_wd);
+    if (slot != NULL && slot->waiter == state) slot->waiter = NULL;
+#else
+    (void) state;
+#endif
 }
+#endif
 
+static async async_watcher(struct astate *state) {
+    watcher_stack *locals = state->locals;
+    async_begin(state);
+            if (locals->watch->err != ASYNC_OK) {
+                async_errno = locals->watch->err;
+                async_exit;
+            }
+            await_while(async_watch_take_(state, locals->watch));
+    async_end;
+}
 
-struct astate *async_gather(size_t n, struct astate **states) {
-    struct astate *state;
-    gathered_stack *stack;
-    size_t i;
+struct async_watch async_watch_path(const char *path, unsigned int mask) {
+    struct async_watch watch;
+    watch.events = 0;
+    watch.count = 0;
+    watch._wd = -1;
+#ifdef ASYNC_WATCH_
+    {
+        struct async_watch_slot_ slot;
+        if (async_inotify_fd_ < 0) {
+            async_inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        }
+        /* Same path watched twice shares the descriptor, its mask becomes the union of both */
+        watch._wd = async_inotify_fd_ >= 0 ? inotify_add_watch(async_inotify_fd_, path, mask | IN_MASK_ADD) : -1;
+        watch.err = watch._wd >= 0 ? ASYNC_OK : ASYNC_EIO;
+        if (watch._wd >= 0 && async_watch_slot_(watch._wd) != NULL) {
+            async_watch_slot_(watch._wd)->refs++;
+        } else if (watch._wd >= 0) {
+            slot.wd = watch._wd;
+            slot.refs = 1;
+            slot.events = 0;
+            slot.count = 0;
+            slot.waiter = NULL;
+            if (!async_arr_push(&async_watch_slots_, slot)) {
+                inotify_rm_watch(async_inotify_fd_, watch._wd);
+                watch._wd = -1;
+                watch.err = ASYNC_ENOMEM;
+            }
+        }
+        if (async_watch_slots_.length == 0 && async_inotify_fd_ >= 0) {
+            close(async_inotify_fd_);
+            async_inotify_fd_ = -1;
+        }
+    }
+#else
+    (void) path;
+    (void) mask;
+    watch.err = ASYNC_ENOMEM;
+#endif
+    return watch;
+}
 
-    ASYNC_PREPARE_NOARGS(async_gatherer, state, gathered_stack, async_gatherer_cancel, fail);
+struct astate *async_watch_events(struct async_watch *watch) {
+    struct astate *state;
+    watcher_stack *stack;
+    ASYNC_PREPARE_NOARGS(async_watcher, state, watcher_stack, async_watcher_cancel, fail);
+    async_set_funcname_(state, "async_watcher");
     stack = state->locals;
-    stack->arr_coros.capacity = n;
-    stack->arr_coros.length = n;
-    stack->arr_coros.data = states;
-    if (!async_create_tasks(n, states)) {
-        STATE_FREE(state);
-        return NULL;
-    }
-    for (i = 0; i < n; i++) {
-        ASYNC_INCREF(stack->arr_coros.data[i]);
-    }
+    stack->watch = watch;
     return state;
     fail:
     return NULL;
 }
 
-typedef struct {
-    double sec;
-    clock_t start;
-} sleeper_stack;
+void async_watch_close(struct async_watch *watch) {
+#ifdef ASYNC_WATCH_
+    struct async_watch_slot_ *slot = async_watch_slot_(watch->_wd);
+    if (slot != NULL && --slot->refs == 0) {
+        if (slot->waiter != NULL) {
+            slot->waiter->_wakeup = async_now(); /* fails on the next cycle */
+            async_wake_(slot->waiter);
+        }
+        inotify_rm_watch(async_inotify_fd_, slot->wd);
+        async_arr_splice(&async_watch_slots_, (size_t) (slot - async_watch_slots_.data), 1);
+        if (async_watch_slots_.length == 0) {
+            close(async_inotify_fd_);
+            async_inotify_fd_ = -1;
+            async_arr_destroy(&async_watch_slots_);
+        }
+    }
+#endif
+    watch->_wd = -1;
+}
 
+/*
+ * Logger. Records are formatted into fixed-size slots of a ring, head is only moved by async_log and
+ * tail only by the drain, so no locks are involved. The drain task is scheduled on demand, yields once
+ * so the rest of the cycle's records join the batch, then hands the whole ring to one writev.
+ */
+struct async_log_record_ {
+    size_t length;
+    char text[ASYNC_LOG_LINE];
+};
 
-static async async_sleeper(struct astate *state) {
-    sleeper_stack *locals = state->locals;
+struct async_log_ring_ {
+    int fd;
+    int draining; /* drain task is scheduled */
+    unsigned long head, tail; /* records written and drained, slot is the counter modulo ASYNC_LOG_SLOTS */
+    unsigned long dropped, reported; /* records lost to full ring and the part of them already reported */
+    size_t skip; /* bytes of the tail record a partial write already took */
+    struct async_log_record_ slots[ASYNC_LOG_SLOTS];
+};
+
+static struct async_log_ring_ *async_log_ = NULL;
+
+#ifdef ASYNC_LOG_
+/* Writes as many drained records as one writev takes, reports drops first */
+static void async_log_flush_(struct async_log_ring_ *log) {
+    struct iovec iov[IOV_MAX];
+    char notice[64];
+    struct async_log_record_ *record;
+    unsigned long i;
+    int n = 0;
+    ssize_t written;
+
+    if (log->dropped != log->reported) {
+        iov[n].iov_base = notice;
+        iov[n++].iov_len = (size_t) sprintf(notice, "[async_log] %lu records dropped\n", log->dropped - log->reported);
+    }
+    for (i = log->tail; i != log->head && n < IOV_MAX; i++) {
+        record = &log->slots[i % ASYNC_LOG_SLOTS];
+        iov[n].iov_base = record->text + (i == log->tail ? log->skip : 0);
+        iov[n++].iov_len = record->length - (i == log->tail ? log->skip : 0);
+    }
+    written = writev(log->fd, iov, n);
+    if (written < 0) {
+        if (errno == EAGAIN || errno == EINTR) return; /* retried next cycle, the ring pushes back meanwhile */
+        log->dropped += log->head - log->tail; /* broken descriptor, don't spin on it */
+        log->reported = log->dropped;
+        log->tail = log->head;
+        log->skip = 0;
+        return;
+    }
+    if (log->dropped != log->reported) {
+        if ((size_t) written < iov[0].iov_len) return; /* notice is rewritten whole next time */
+        written -= (ssize_t) iov[0].iov_len;
+        log->reported = log->dropped;
+    }
+    while (log->tail != log->head && written > 0) {
+        record = &log->slots[log->tail % ASYNC_LOG_SLOTS];
+        if ((size_t) written < record->length - log->skip) {
+            log->skip += (size_t) written;
+            return;
+        }
+        written -= (ssize_t) (record->length - log->skip);
+        log->skip = 0;
+        log->tail++;
+    }
+}
+#endif
+
+static async async_log_drain(struct astate *state) {
     async_begin(state);
-            locals->start = clock();
-            await_while((double) (clock() - locals->start) / CLOCKS_PER_SEC < locals->sec);
+            while (async_log_ != NULL && async_log_->tail != async_log_->head) {
+                async_yield;
+#ifdef ASYNC_LOG_
+                if (async_log_ != NULL) async_log_flush_(async_log_);
+#endif
+            }
+            if (async_log_ != NULL) async_log_->draining = 0;
     async_end;
 }
 
-struct astate *async_sleep(double delay) {
-    struct astate *state;
-    sleeper_stack *stack;
-    if (delay == 0) {
-        ASYNC_PREPARE_NOARGS(async_yielder, state, ASYNC_NONE, NULL, fail);
-    } else {
-        ASYNC_PREPARE_NOARGS(async_sleeper, state, sleeper_stack, NULL, fail);
-        stack = state->locals; /* Yet another predefined locals trick for mere optimisation, use async_alloc_ in real adapter functions instead. */
-        stack->sec = delay;
+#ifndef ASYNC_NO_CANCEL
+static void async_log_drain_cancel(struct astate *state) {
+    (void) state;
+    if (async_log_ != NULL) async_log_->draining = 0;
+}
+#endif
+
+async_error async_log_open(int fd) {
+#ifdef ASYNC_LOG_
+    if (async_log_ != NULL) return ASYNC_EINVAL_STATE;
+    async_log_ = calloc(1, sizeof(*async_log_));
+    if (async_log_ == NULL) return ASYNC_ENOMEM;
+    async_log_->fd = fd;
+    return ASYNC_OK;
+#else
+    (void) fd;
+    return ASYNC_ENOMEM;
+#endif
+}
+
+int async_log(const char *fmt, ...) {
+#ifdef ASYNC_LOG_
+    struct async_log_record_ *record;
+    struct astate *drain;
+    va_list ap;
+    int n;
+
+    if (async_log_ == NULL) return 0;
+    if (async_log_->head - async_log_->tail >= ASYNC_LOG_SLOTS) {
+        async_log_->dropped++;
+        return 0;
     }
-    return state;
+    if (!async_log_->draining) {
+        ASYNC_PREPARE_NOARGS(async_log_drain, drain, ASYNC_NONE, async_log_drain_cancel, fail);
+        async_set_funcname_(drain, "async_log_drain");
+        if (!async_create_task(drain)) goto fail; /* frees the drain */
+        async_log_->draining = 1;
+    }
+    record = &async_log_->slots[async_log_->head % ASYNC_LOG_SLOTS];
+    n = sprintf(record->text, "%14.6f ", async_now());
+    va_start(ap, fmt);
+    n += vsnprintf(record->text + n, ASYNC_LOG_LINE - (size_t) n, fmt, ap);
+    va_end(ap);
+    if (n > ASYNC_LOG_LINE - 1) n = ASYNC_LOG_LINE - 1; /* truncated */
+    if (n == 0 || record->text[n - 1] != '\n') record->text[n++] = '\n';
+    record->length = (size_t) n;
+    async_log_->head++;
+    return 1;
     fail:
-    return NULL;
+    async_log_->dropped++;
+    return 0;
+#else
+    (void) fmt;
+    return 0;
+#endif
 }
 
-typedef struct {
-    double sec;
-    clock_t start;
-} waiter_stack;
+int async_log_has_space(size_t n) {
+    return async_log_ == NULL || async_log_->head - async_log_->tail + n <= ASYNC_LOG_SLOTS;
+}
 
-static void async_waiter_cancel(struct astate *state) {
-    struct astate *child = state->args;
-    if (child == NULL) return;
-    if (async_create_task(child)) {
-        if (!async_done(child)) {
-            async_cancel(child);
+unsigned long async_log_dropped(void) {
+    return async_log_ != NULL ? async_log_->dropped : 0;
+}
+
+void async_log_close(void) {
+    if (async_log_ == NULL) return;
+#ifdef ASYNC_LOG_
+    {
+        unsigned long tail;
+        do { /* write out what the drain didn't get to, until the descriptor stops taking records */
+            tail = async_log_->tail;
+            async_log_flush_(async_log_);
+        } while (async_log_->tail != async_log_->head && async_log_->tail != tail);
+    }
+#endif
+    free(async_log_);
+    async_log_ = NULL;
+}
+
+#ifdef ASYNC_WATCHDOG
+#ifdef ASYNC_NO_REFCNT
+    #define async_referenced_(state) ((state)->_flags & _ASYNC_FLAG_OWNED)
+#else
+    #define async_referenced_(state) ((state)->_refcnt != 0)
+#endif
+
+size_t async_watchdog_sweep(double threshold, FILE *f) {
+    struct astate *state;
+    const char *kind;
+    double now = async_now();
+    size_t n = 0;
+
+    for (state = async_live_; state != NULL; state = state->_live_next) {
+        if (!async_done(state) && state->_next != NULL) {
+            state->_next->_flags |= _ASYNC_FLAG_AWAITED;
+        }
+    }
+    for (state = async_live_; state != NULL; state = state->_live_next) {
+        if (state->_steps != state->_seen_steps) {
+            state->_seen_steps = state->_steps;
+            state->_since = now;
+            continue;
         }
-        ASYNC_DECREF(child);
+        if (now - state->_since <= threshold) continue;
+        if (async_done(state) || (!async_sheduled(state) && state->_async_k == ASYNC_INIT)) {
+            /* finished but referenced, or never scheduled. Awaited ones are released by whoever awaits them */
+            if ((async_done(state) && !async_referenced_(state)) || (state->_flags & _ASYNC_FLAG_AWAITED)) continue;
+            kind = "leaked";
+        } else {
+            /* waits for a timer, even expired one while the loop isn't running, or for an unfinished child */
+            if (state->_wakeup != 0 || (state->_next != NULL && !async_done(state->_next))) continue;
+            kind = "stuck";
+        }
+        fprintf(f, "%s %s:%u %.3f s\n", kind, state->_funcname ? state->_funcname : "?", state->_async_k,
+                now - state->_since);
+        n++;
     }
+    for (state = async_live_; state != NULL; state = state->_live_next) {
+        state->_flags &= ~_ASYNC_FLAG_AWAITED;
+    }
+    return n;
 }
 
-static async async_waiter(struct astate *state) {
-    waiter_stack *locals = state->locals;
-    struct astate *child = state->args;
+typedef struct {
+    double period, threshold, deadline;
+} watchdog_stack;
+
+static async async_watchdog_(struct astate *state) {
+    watchdog_stack *locals = state->locals;
     async_begin(state);
-            if (!async_create_task(child)) {
-                state->args = NULL;
-                async_errno = ASYNC_ENOMEM;
-                async_exit;
+            while (event_loop->n_tasks > 1) {
+                locals->deadline = async_now() + locals->period;
+                await_while(async_park_(state, locals->deadline));
+                async_watchdog_sweep(locals->threshold, stderr);
             }
-            locals->start = clock();
-            await_while(!async_done(child) && (double) (clock() - locals->start) / CLOCKS_PER_SEC < locals->sec);
-            if (!async_done(child)) {
-                async_errno = ASYNC_ECANCELED;
-                async_cancel(child);
-            }
-            ASYNC_DECREF(child);
     async_end;
 }
 
-struct astate *async_wait_for(struct astate *child, double timeout) {
+struct astate *async_watchdog(double period, double threshold) {
     struct astate *state;
-    waiter_stack *stack;
-    if (child == NULL) { return NULL; }
-    ASYNC_PREPARE_NOARGS(async_waiter, state, waiter_stack, async_waiter_cancel, fail);
-    stack = state->locals; /* Predefine locals. This trick can be used to create friendly methods. */
-    state->args = child;
-    stack->sec = timeout;
-    ASYNC_INCREF(child);
+    watchdog_stack *stack;
+    ASYNC_PREPARE_NOARGS(async_watchdog_, state, watchdog_stack, NULL, fail);
+    stack = state->locals;
+    stack->period = period;
+    stack->threshold = threshold;
     return state;
     fail:
-    STATE_FREE(child);
     return NULL;
 }
+#endif
 
-void *async_alloc_(struct astate *state, size_t size) {
-    void *mem;
-    if (state == NULL) { return NULL; }
-    mem = malloc(size);
-    if (mem == NULL) { return NULL; }
-    if (!async_arr_push(&state->_allocs, mem)) {
-        free(mem);
-        return NULL;
-    }
-    return mem;
+/*
+ * Checkpoints. File is "A2CP", version byte, clock at save as native double, varint number of states, then per state:
+ * varint name length and name of its registered type, varint _async_k, err and cancelled flag, native doubles
+ * _wakeup and _deadline, varint args handle and index of awaited state (both + 1, 0 for none), varint locals size
+ * and the locals bytes.
+ */
+struct async_checkpoint_type_ {
+    const char *name;
+    AsyncCallback func;
+    size_t stack_size;
+    size_t stack_offset;
+    AsyncRebaseCallback rebase;
+};
+
+static async_arr_t(struct async_checkpoint_type_) async_checkpoint_types_ = {NULL, 0, 0};
+
+static const char async_checkpoint_magic_[5] = {'A', '2', 'C', 'P', 1};
+
+static void async_sleeper_rebase_(struct astate *state, double shift) {
+    sleeper_stack *locals = state->locals;
+    if (locals->deadline != 0) locals->deadline += shift;
 }
 
-int async_free_(struct astate *state, void *mem) {
+static struct async_checkpoint_type_ *async_checkpoint_find_(AsyncCallback func, const char *name) {
     size_t i;
-    void *obj;
+    for (i = 0; i < async_checkpoint_types_.length; i++) {
+        struct async_checkpoint_type_ *type = &async_checkpoint_types_.data[i];
+        if (func != NULL ? type->func == func : strcmp(type->name, name) == 0) return type;
+    }
+    return NULL;
+}
 
-    i = state->_allocs.length;
-    while (i--) {
-        obj = state->_allocs.data[i];
-        if (obj == mem) {
-            free(obj);
-            async_arr_splice(&state->_allocs, i, 1);
+async_error async_checkpoint_register_(const char *name, AsyncCallback func, size_t stack_size, size_t stack_offset,
+                                       AsyncRebaseCallback rebase) {
+    struct async_checkpoint_type_ type;
+    if (async_checkpoint_types_.length == 0) { /* adapters tasks may be awaiting */
+        type.name = "async_sleeper";
+        type.func = async_sleeper;
+        type.stack_size = sizeof(sleeper_stack);
+        type.stack_offset = _ASYNC_COMPUTE_OFFSET(struct astate, sleeper_stack);
+        type.rebase = async_sleeper_rebase_;
+        if (!async_arr_push(&async_checkpoint_types_, type)) return ASYNC_ENOMEM;
+        type.name = "async_yielder";
+        type.func = async_yielder;
+        type.stack_size = sizeof(ASYNC_NONE);
+        type.stack_offset = _ASYNC_COMPUTE_OFFSET(struct astate, ASYNC_NONE);
+        type.rebase = NULL;
+        if (!async_arr_push(&async_checkpoint_types_, type)) return ASYNC_ENOMEM;
+    }
+    if (name == NULL) return ASYNC_OK;
+    if (async_checkpoint_find_(func, NULL) != NULL || async_checkpoint_find_(NULL, name) != NULL) {
+        return ASYNC_EINVAL_STATE;
+    }
+    type.name = name;
+    type.func = func;
+    type.stack_size = stack_size;
+    type.stack_offset = stack_offset;
+    type.rebase = rebase;
+    return async_arr_push(&async_checkpoint_types_, type) ? ASYNC_OK : ASYNC_ENOMEM;
+}
+
+/* Handle of args in the caller's table + 1, 0 for NULL args, returns 0 if args isn't in the table */
+static int async_checkpoint_handle_(void *args, void **handles, size_t n_handles, unsigned long *handle) {
+    size_t i;
+    *handle = 0;
+    if (args == NULL) return 1;
+    for (i = 0; i < n_handles; i++) {
+        if (handles[i] == args) {
+            *handle = (unsigned long) i + 1;
             return 1;
         }
     }
     return 0;
 }
 
-int async_free_later_(struct astate *state, void *mem) {
-    if (mem == NULL || !async_arr_push(&state->_allocs, mem)) return 0;
-    return 1;
+async_error async_checkpoint_save(const char *path, void **handles, size_t n_handles) {
+    async_arr_t(struct astate *) saved = {NULL, 0, 0};
+    async_arr_t(unsigned int) slots = {NULL, 0, 0};
+    struct async_checkpoint_type_ *type;
+    struct astate *state;
+    async_error err = async_checkpoint_register_(NULL, NULL, 0, 0, NULL);
+    double now = async_now();
+    unsigned long handle;
+    size_t i, len;
+    FILE *f = NULL;
+
+    if (err != ASYNC_OK) return err;
+    /* Tasks of these loops aren't all kept in tasks_head */
+    if (event_loop == &async_soa_loop_.base || event_loop == &async_mlfq_loop_.base) return ASYNC_EINVAL_STATE;
+    /* Unfinished tasks and the finished ones they still have to pick up, awaited ones are marked like in teardown */
+    for (state = event_loop->tasks_head; state != NULL; state = state->_task_next) {
+        if (!async_done(state) && state->_next != NULL) state->_next->_flags |= _ASYNC_FLAG_AWAITED;
+    }
+    for (state = event_loop->tasks_head; state != NULL; state = state->_task_next) {
+        if (async_done(state) && !(state->_flags & _ASYNC_FLAG_AWAITED)) continue;
+        if (!async_arr_push(&saved, state) || !async_arr_push(&slots, state->_slot)) {
+            err = ASYNC_ENOMEM;
+            goto done;
+        }
+        state->_slot = (unsigned int) saved.length; /* index + 1 of the state in the checkpoint */
+    }
+    for (i = 0; i < saved.length && err == ASYNC_OK; i++) {
+        state = saved.data[i];
+        if (async_checkpoint_find_(state->_func, NULL) == NULL ||
+            !async_checkpoint_handle_(state->args, handles, n_handles, &handle) ||
+#ifndef ASYNC_NO_ALLOCS
+            state->_allocs.length != 0 || /* locals may point into memory that won't exist after restore */
+#endif
+            (state->_next != NULL && !async_done(state) && !(state->_next->_flags & _ASYNC_FLAG_SHEDULED))) {
+            err = ASYNC_EINVAL_STATE;
+        }
+    }
+    if (err != ASYNC_OK) goto done;
+    f = fopen(path, "wb");
+    if (f == NULL) {
+        err = ASYNC_EIO;
+        goto done;
+    }
+    fwrite(async_checkpoint_magic_, sizeof(async_checkpoint_magic_), 1, f);
+    fwrite(&now, sizeof(now), 1, f);
+    async_write_varint_(f, (unsigned long) saved.length);
+    for (i = 0; i < saved.length; i++) {
+        state = saved.data[i];
+        type = async_checkpoint_find_(state->_func, NULL);
+        len = strlen(type->name);
+        async_write_varint_(f, (unsigned long) len);
+        fwrite(type->name, 1, len, f);
+        async_write_varint_(f, state->_async_k);
+        async_write_varint_(f, (unsigned long) (unsigned int) state->err);
+        async_write_varint_(f, (unsigned long) ((state->_flags & _ASYNC_FLAG_MUST_CANCEL) != 0));
+        fwrite(&state->_wakeup, sizeof(state->_wakeup), 1, f);
+        fwrite(&state->_deadline, sizeof(state->_deadline), 1, f);
+        async_checkpoint_handle_(state->args, handles, n_handles, &handle);
+        async_write_varint_(f, handle);
+        async_write_varint_(f, state->_next != NULL && !async_done(state) ? state->_next->_slot : 0);
+        async_write_varint_(f, (unsigned long) type->stack_size);
+        fwrite(state->locals, 1, type->stack_size, f);
+    }
+    if (ferror(f)) err = ASYNC_EIO; /* any of the writes failed */
+    if (fclose(f) != 0) err = ASYNC_EIO;
+    done:
+    for (state = event_loop->tasks_head; state != NULL; state = state->_task_next) {
+        state->_flags &= ~_ASYNC_FLAG_AWAITED;
+    }
+    for (i = 0; i < slots.length; i++) {
+        saved.data[i]->_slot = slots.data[i];
+    }
+    async_arr_destroy(&saved);
+    async_arr_destroy(&slots);
+    return err;
+}
+
+async_error async_checkpoint_restore(const char *path, void **handles, size_t n_handles) {
+    async_arr_t(struct astate *) restored = {NULL, 0, 0};
+    async_arr_t(unsigned long) awaits = {NULL, 0, 0};
+    struct async_checkpoint_type_ *type;
+    struct astate *state;
+    char magic[sizeof(async_checkpoint_magic_)], name[256];
+    unsigned long n, i, k, e, cancelled, handle, next, size;
+    double saved_now, shift;
+    async_error err = async_checkpoint_register_(NULL, NULL, 0, 0, NULL);
+    FILE *f;
+
+    if (err != ASYNC_OK) return err;
+    f = fopen(path, "rb");
+    if (f == NULL) return ASYNC_EIO;
+    err = ASYNC_EINVAL_STATE;
+    if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, async_checkpoint_magic_, sizeof(magic)) != 0 ||
+        fread(&saved_now, sizeof(saved_now), 1, f) != 1 || !async_read_varint_(f, &n)) {
+        goto fail;
+    }
+    shift = async_now() - saved_now;
+    for (i = 0; i < n; i++) {
+        if (!async_read_varint_(f, &size) || size >= sizeof(name) || fread(name, 1, size, f) != size) goto fail;
+        name[size] = '\0';
+        type = async_checkpoint_find_(NULL, name);
+        if (type == NULL || !async_read_varint_(f, &k) || !async_read_varint_(f, &e) ||
+            !async_read_varint_(f, &cancelled)) {
+            goto fail;
+        }
+        state = async_new_state_(type->func, NULL, type->stack_size, type->stack_offset);
+        if (state == NULL || !async_arr_push(&restored, state)) {
+            if (state != NULL) STATE_FREE(state);
+            err = ASYNC_ENOMEM;
+            goto fail;
+        }
+        if (fread(&state->_wakeup, sizeof(state->_wakeup), 1, f) != 1 ||
+            fread(&state->_deadline, sizeof(state->_deadline), 1, f) != 1 ||
+            !async_read_varint_(f, &handle) || handle > n_handles || !async_read_varint_(f, &next) || next > n ||
+            !async_read_varint_(f, &size) || size != type->stack_size ||
+            fread(state->locals, 1, size, f) != size || !async_arr_push(&awaits, next)) {
+            goto fail;
+        }
+        state->_async_k = (unsigned int) k;
+        state->err = (async_error) (int) (unsigned int) e;
+        state->args = handle ? handles[handle - 1] : NULL;
+        if (state->_wakeup != 0) state->_wakeup += shift;
+        if (state->_deadline != 0) state->_deadline += shift;
+        if (type->rebase != NULL) type->rebase(state, shift);
+        if (async_done(state)) {
+            _ASYNC_SELF_DECREF(state); /* finished states only live while their parents hold them */
+        }
+#ifndef ASYNC_NO_CANCEL
+        if (cancelled) state->_flags |= _ASYNC_FLAG_MUST_CANCEL;
+#else
+        (void) cancelled;
+#endif
+    }
+    fclose(f);
+    f = NULL;
+    err = ASYNC_OK;
+    for (i = 0; i < n; i++) {
+        if (awaits.data[i] == 0) continue;
+        restored.data[i]->_next = restored.data[awaits.data[i] - 1];
+        ASYNC_INCREF(restored.data[i]->_next);
+        _ASYNC_SET_PARENT(restored.data[i]->_next, restored.data[i]);
+    }
+    if (n > 0 && !async_create_tasks(restored.length, restored.data)) {
+        err = async_create_error(restored.length);
+    }
+    if (err == ASYNC_OK) {
+        async_arr_destroy(&restored);
+        async_arr_destroy(&awaits);
+        return ASYNC_OK;
+    }
+    fail:
+    if (f != NULL) fclose(f);
+    for (i = 0; i < restored.length; i++) {
+        STATE_FREE(restored.data[i]);
+    }
+    async_arr_destroy(&restored);
+    async_arr_destroy(&awaits);
+    return err;
 }
 
 struct async_event_loop *async_get_event_loop(void) {
@@ -553,8 +4102,12 @@ const char *async_strerror(async_error err) {
             return "MEMORY ALLOCATION ERROR";
         case ASYNC_ECANCELED:
             return "COROUTINE WAS CANCELLED";
+        case ASYNC_EAGAIN:
+            return "EVENT LOOP IS OVERLOADED";
         case ASYNC_EINVAL_STATE:
             return "INVALID STATE WAS PASSED TO COROUTINE";
+        case ASYNC_EIO:
+            return "INPUT/OUTPUT ERROR";
         default:
             return "UNKNOWN ERROR";
     }
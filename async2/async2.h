@@ -46,6 +46,10 @@ SOFTWARE.
  *    subroutine. Generally best to avoid them.
  * 3. As with protothreads, you can't make blocking system calls and preserve the async semantics.
  *    These must be changed into non-blocking calls that test a condition.
+ *
+ * Single-header use: #define ASYNC2_IMPLEMENTATION before including this file in exactly one source file
+ * to compile the library into it (async2.c must stay next to this header). Tasks created in that file
+ * call the default event loop directly instead of through its function pointers.
  */
 
 #include <stddef.h> /* NULL, offsetof */
@@ -59,6 +63,25 @@ SOFTWARE.
     #include <stdio.h> /* fprintf, stderr */
 #endif
 
+#if defined(ASYNC_PROFILE) || defined(ASYNC_WATCHDOG)
+    #include <stdio.h> /* FILE */
+#endif
+
+/*
+ * Feature stripping for programs that don't need some of the features, must be the same for the library and its users:
+ * ASYNC_NO_CANCEL removes cancellation: async_cancel, cancel callbacks and async_wait_for.
+ * ASYNC_NO_ALLOCS removes memory managed by states: async_alloc, async_free, async_free_later.
+ * ASYNC_NO_REFCNT replaces reference counter with a single owner flag, so a state can't be awaited
+ * (fawait, gather, wait_for or ASYNC_INCREF) by more than one coroutine at a time.
+ *
+ * ASYNC_PROFILE adds the sampling profiler (async_profile_start) and the critical path profiler (async_critpath_start):
+ * every state remembers the coroutine awaiting it and the name of its function. Must be the same for the library
+ * and its users as well.
+ *
+ * ASYNC_WATCHDOG adds the stuck and leaked states detector (async_watchdog): every state counts suspension points
+ * it passes and all allocated states are tracked. Must be the same for the library and its users too.
+ */
+
 /*
  * The async computation status
  */
@@ -67,11 +90,16 @@ typedef enum ASYNC_EVT {
 } async;
 
 typedef enum ASYNC_ERR {
-    ASYNC_OK = 0, ASYNC_ENOMEM = 12, ASYNC_ECANCELED = 42, ASYNC_EINVAL_STATE
+    ASYNC_OK = 0, ASYNC_EIO = 5, ASYNC_EAGAIN = 11, ASYNC_ENOMEM = 12, ASYNC_ECANCELED = 42, ASYNC_EINVAL_STATE
 } async_error;
 
 #define _ASYNC_FLAG_SHEDULED    0x1 /* 0b1 */
 #define _ASYNC_FLAG_MUST_CANCEL 0x2 /* 0b10 */
+#define _ASYNC_FLAG_BLOCK       0x4 /* 0b100, state is a member of block allocated by async_new_many */
+#define _ASYNC_FLAG_AWAITED     0x8 /* 0b1000, state is awaited by another task, used by loop teardown */
+#define _ASYNC_FLAG_OWNED       0x10 /* 0b10000, state is referenced by another coroutine, replaces _refcnt with ASYNC_NO_REFCNT */
+#define _ASYNC_FLAG_LATE        0x20 /* 0b100000, state was resumed past its deadline and counted as a miss */
+#define _ASYNC_FLAG_POLLING     0x40 /* 0b1000000, last resume returned from await_while with the condition still true */
 
 /*
  * Core async type to imply empty locals when creating new coro
@@ -88,6 +116,42 @@ typedef async (*AsyncCallback)(struct astate *);
 
 typedef void (*AsyncCancelCallback)(struct astate *);
 
+/* Moves absolute monotonic times a restored state keeps in its locals by shift seconds, see async_checkpoint_register */
+typedef void (*AsyncRebaseCallback)(struct astate *, double shift);
+
+/*
+ * Drift-free periodic timer, fires on exact multiples of period of the monotonic clock
+ */
+struct async_interval {
+    double period;
+    double next; /* time of the next tick, 0 until the first await_tick, negative if period is invalid */
+    unsigned long missed; /* ticks skipped because coroutine wasn't resumed in time */
+};
+
+/*
+ * Loop metrics published by async_metrics_open into a shared memory-mapped file, once per loop cycle.
+ * The loop makes seq odd while it writes, readers copy the struct until they see the same even seq
+ * before and after the copy (async_metrics_snapshot), so the loop never waits for them.
+ */
+#define ASYNC_METRICS_MAGIC 0x4132534dUL /* "A2SM" */
+
+#define ASYNC_METRICS_BUCKETS 16
+
+struct async_metrics {
+    unsigned long magic; /* ASYNC_METRICS_MAGIC once the loop has published something */
+    volatile unsigned long seq;
+    double updated; /* async_monotonic() of the loop process at the end of the last published cycle */
+    unsigned long cycles, resumes; /* loop cycles and tasks resumed since the file was opened */
+    double resumes_per_sec; /* over the last full second */
+    unsigned long tasks_live, tasks_runnable; /* n_tasks and n_runnable of the loop */
+    unsigned long states_live; /* states allocated and not yet freed, scheduled or not */
+    unsigned long arena_bytes; /* task arena memory committed */
+    unsigned long idle_wakeups, rejected_tasks, deadline_misses; /* counters of the loop */
+    unsigned long timers_armed; /* timers of parked tasks in the last cycle */
+    unsigned long timer_expiries; /* resumes caused by a timer rather than a finished child */
+    unsigned long cycle_us[ASYNC_METRICS_BUCKETS]; /* cycles that took less than 2^i microseconds, the last one counts the rest */
+};
+
 /*
  * Figures out proper offset from struct beginning to T_b
  * in order to allocate struct capable storing both Types a and b in one go
@@ -105,19 +169,46 @@ struct astate {
     void *locals; /* function's stack pointer (locals_t) to be passed with state to the async function */
     async_error err; /* ASYNC_OK(0) if state has no errors, other async_error otherwise, also might be a custom error code defined by function that sets errno itself */
     /* internal numeric values: */
-    size_t _refcnt; /* reference count number of functions still using this state. 1 by default, because coroutine owns itself too. If number of references is 0, the state becomes invalid and will be freed by the event loop soon */
     unsigned int _async_k; /* current execution state. ASYNC_EVT if <= ASYNC_DONE and number of line in the function otherwise (means that state (or its function) is still running) */
+    #ifndef ASYNC_NO_REFCNT
+    size_t _refcnt; /* reference count number of functions still using this state. 1 by default, because coroutine owns itself too. If number of references is 0, the state becomes invalid and will be freed by the event loop soon */
+    #endif
+    double _wakeup; /* monotonic time until which the event loop won't resume the state, 0 if no timer is armed. If _next is set too, state is resumed by whichever comes first */
+    double _deadline; /* monotonic time the state should finish by, 0 if it has none. Used by async_edf_event_loop */
     unsigned char _flags; /* default event loop functions use first 2 bit flags: FLAG_SHEDULED and FLAG_MUST_CANCEL, custom event loop might support more */
+    unsigned char _level, _idle; /* feedback level and number of idle resumes in a row, used by async_mlfq_event_loop */
+    unsigned int _slot; /* index of the state in table-driven event loops like async_soa_event_loop, unused by the default one */
     /* containers: */
     AsyncCallback _func; /* function to be called by the event loop */
+    #ifndef ASYNC_NO_CANCEL
     AsyncCancelCallback _cancel; /* function to be called in case of cancelling state, can be NULL */
+    #endif
     s_astate _next; /* child state used by fawait */
+    s_astate _task_prev, _task_next; /* neighbours in the event loop's tasks list, valid only while the state is scheduled */
 
+    #ifndef ASYNC_NO_ALLOCS
     async_arr_t(void*) _allocs; /* array of memory blocks allocated by async_alloc and managed by the event loop */
+    #endif
 
     #ifdef ASYNC_DEBUG
     const char *debug_taskname; /* must never be explicitly initialized */
     #endif
+
+    #if defined(ASYNC_PROFILE) || defined(ASYNC_WATCHDOG)
+    const char *_funcname; /* name of _func, recorded by async_begin on the first resume */
+    #endif
+
+    #ifdef ASYNC_PROFILE
+    s_astate _parent; /* coroutine awaiting the state with fawait, gather or wait_for, NULL for top-level tasks */
+    size_t _span_id; /* number of the state in critical path records, 0 while it isn't recorded */
+    double _spawned; /* monotonic time the state was scheduled at, valid while _span_id is set */
+    #endif
+
+    #ifdef ASYNC_WATCHDOG
+    unsigned int _steps, _seen_steps; /* suspension points passed by the coroutine, and their number at the last sweep */
+    double _since; /* monotonic time the watchdog last saw the state progress at */
+    s_astate _live_prev, _live_next; /* neighbours in the list of all allocated states */
+    #endif
 };
 
 struct async_event_loop {
@@ -134,18 +225,99 @@ struct async_event_loop {
 
     void (*run_until_complete)(struct astate *main_state);
 
-    /* Main tasks queue */
-    async_arr_t(struct astate *) events_queue;
-    /* Helper stack to keep track of vacant indices, allows to avoid slow array
-    * slicing when there's a lot of tasks with a cost of bigger memory footprint */
-    async_arr_t(size_t) vacant_queue;
+    /* Main tasks queue, intrusive doubly linked list threaded through astate's _task_prev and _task_next,
+    * so tasks are added and removed in O(1) without allocations */
+    struct astate *tasks_head, *tasks_tail;
+    /* Tolerance in seconds timers created by async_sleep may be delayed by, so expiries falling into
+    * the same window are coalesced into one wakeup. 0 disables coalescing */
+    double timer_slack;
+    /* Number of times the loop blocked waiting for the nearest timer */
+    unsigned long idle_wakeups;
+    /* Monotonic time read once per loop cycle and shared by all the tasks, 0 while loop isn't running */
+    double now;
+    /* Admission limits: number of live tasks and number of runnable tasks, those resumed during the last loop
+    * cycle except for ones still waiting in await_capacity. Adding tasks beyond them fails with ASYNC_EAGAIN,
+    * 0 means unlimited */
+    size_t max_tasks, max_runnable;
+    /* Current number of live tasks and number of runnable tasks */
+    size_t n_tasks, n_runnable;
+    /* Number of tasks rejected by admission control */
+    unsigned long rejected_tasks;
+    /* Number of tasks resumed past their deadline by deadline-aware loops, every task is counted once */
+    unsigned long deadline_misses;
+    /* Deadline-aware loops cancel tasks past their deadline instead of resuming them after the others.
+    * Ignored with ASYNC_NO_CANCEL, late tasks are always resumed after the others then */
+    int shed_late;
+    /* Called with a task that was cancelled, released or had its timer moved by someone else, so loops that
+    * don't look at parked tasks every cycle notice the change. NULL if the loop doesn't need it */
+    void (*wake)(struct astate *state);
 };
 
 extern struct async_event_loop *async_default_event_loop;
 
+/*
+ * Optional event loop mirroring status of every task into compact structure-of-arrays table,
+ * so runnable tasks are found with SIMD scans (AVX2 or SSE2 when compiler targets them, scalar otherwise)
+ * without touching states that wait for children or timers. Must be used as is, not copied.
+ */
+extern struct async_event_loop *async_soa_event_loop;
+
+/*
+ * Optional event loop with multi-level feedback queue: tasks resumed again and again without progress
+ * (await(cond) or async_yield polling loops) are demoted to levels visited less often, and promoted back
+ * once they progress, park on a child or timer, or finish. Must be used as is, not copied.
+ */
+extern struct async_event_loop *async_mlfq_event_loop;
+
+/*
+ * Optional event loop resuming runnable tasks in earliest-deadline-first order, a task with deadline is resumed
+ * again within the cycle until it parks on a timer, child or condition (up to ASYNC_EDF_BUDGET extra resumes
+ * per cycle), tasks without deadline are resumed after them. Tasks already past their deadline are resumed last or cancelled if loop->shed_late is set.
+ * Children awaited by a task with deadline inherit it. Must be used as is, not copied.
+ */
+extern struct async_event_loop *async_edf_event_loop;
+
+/*
+ * Optional event loop running on virtual time: async_monotonic() returns its clock while it is the current loop,
+ * the clock jumps to the nearest timer as soon as nothing is runnable. Runnable tasks are resumed in order
+ * shuffled by generator seeded with async_sim_seed, so runs are reproducible. Must be used as is, not copied.
+ */
+extern struct async_event_loop *async_sim_event_loop;
+
+#ifdef ASYNC_NO_REFCNT
+#define ASYNC_INCREF(coro) ((coro)->_flags |= _ASYNC_FLAG_OWNED)
+
+#define ASYNC_DECREF(coro) ((coro)->_flags &= ~_ASYNC_FLAG_OWNED, async_wake_(coro))
+
+/* Running coroutine keeps itself alive by not being done yet */
+#define _ASYNC_SELF_DECREF(coro) (void) 0
+#else
 #define ASYNC_INCREF(coro) coro->_refcnt++
 
-#define ASYNC_DECREF(coro) coro->_refcnt--
+#define ASYNC_DECREF(coro) (--(coro)->_refcnt == 0 ? async_wake_(coro) : (void) 0)
+
+/* Drop the reference coroutine holds on itself until exited or cancelled, the loop running it sees that anyway */
+#define _ASYNC_SELF_DECREF(coro) ((coro)->_refcnt--)
+#endif
+
+#ifdef ASYNC_PROFILE
+#define _ASYNC_SET_PARENT(coro, parent) ((coro)->_parent = (parent))
+#else
+#define _ASYNC_SET_PARENT(coro, parent) (void) 0
+#endif
+
+#if defined(ASYNC_PROFILE) || defined(ASYNC_WATCHDOG)
+/* Keeps the name set by whoever created the state, if any */
+#define _ASYNC_SET_FUNCNAME(coro) ((coro)->_funcname = (coro)->_funcname ? (coro)->_funcname : __func__)
+#else
+#define _ASYNC_SET_FUNCNAME(coro) (void) 0
+#endif
+
+#ifdef ASYNC_WATCHDOG
+#define _ASYNC_STEP(coro) ((coro)->_steps++)
+#else
+#define _ASYNC_STEP(coro) (void) 0
+#endif
 
 #define ASYNC_XINCREF(coro) if(coro) ASYNC_INCREF(coro)
 
@@ -163,12 +335,13 @@ extern struct async_event_loop *async_default_event_loop;
     switch(_async_p->_async_k) {                           \
     case ASYNC_INIT:                                       \
         fprintf(stderr, "<ADEBUG> Begin '%s'\n", __func__);\
-        _async_p->debug_taskname = __func__
+        _async_p->debug_taskname = __func__;               \
+        _ASYNC_SET_FUNCNAME(_async_p)
 #else
 #define async_begin(st)                     \
     struct astate *_async_p = st;           \
     switch(_async_p->_async_k) {            \
-    case ASYNC_INIT: (void)0
+    case ASYNC_INIT: _ASYNC_SET_FUNCNAME(_async_p)
 #endif
 
 /*
@@ -177,7 +350,8 @@ extern struct async_event_loop *async_default_event_loop;
 #ifdef ASYNC_DEBUG
 #define async_end                                                                                        \
     _async_p->_async_k=ASYNC_DONE;                                                                       \
-    ASYNC_DECREF(_async_p);                                                                              \
+    _ASYNC_STEP(_async_p);                                                                               \
+    _ASYNC_SELF_DECREF(_async_p);                                                                        \
     fprintf(stderr, "<ADEBUG> Ended '%s'\n", __func__);                                                  \
     /* fall through */                                                                                   \
     case ASYNC_DONE:                                                                                     \
@@ -189,7 +363,8 @@ extern struct async_event_loop *async_default_event_loop;
 #else
 #define async_end                           \
     _async_p->_async_k = ASYNC_DONE;        \
-    ASYNC_DECREF(_async_p);                 \
+    _ASYNC_STEP(_async_p);                  \
+    _ASYNC_SELF_DECREF(_async_p);           \
     /* fall through */                      \
     case ASYNC_DONE:                        \
         return ASYNC_DONE;                  \
@@ -206,13 +381,18 @@ extern struct async_event_loop *async_default_event_loop;
  * duplicate writes from the caller-saved design.
  */
 #ifdef ASYNC_DEBUG
-#define await_while(cond)                                                                                            \
-    _async_p->_async_k = __LINE__; /* fall through */  case __LINE__:                                                \
-    if (cond) return (fprintf(stderr, "<ADEBUG> Awaited in '%s' %s(%d)\n", __func__, __FILE__, __LINE__), ASYNC_CONT)
+#define await_while(cond)                                                                                              \
+    _async_p->_async_k = __LINE__; /* fall through */  case __LINE__:                                                  \
+    if (cond) return (fprintf(stderr, "<ADEBUG> Awaited in '%s' %s(%d)\n", __func__, __FILE__, __LINE__),             \
+                      _async_p->_flags |= _ASYNC_FLAG_POLLING, ASYNC_CONT);                                          \
+    _async_p->_flags &= ~_ASYNC_FLAG_POLLING;                                                                          \
+    _ASYNC_STEP(_async_p)
 #else
-#define await_while(cond)                                             \
-    _async_p->_async_k = __LINE__; /* fall through */  case __LINE__: \
-    if (cond) return ASYNC_CONT
+#define await_while(cond)                                                         \
+    _async_p->_async_k = __LINE__; /* fall through */  case __LINE__:             \
+    if (cond) return (_async_p->_flags |= _ASYNC_FLAG_POLLING, ASYNC_CONT);       \
+    _async_p->_flags &= ~_ASYNC_FLAG_POLLING;                                     \
+    _ASYNC_STEP(_async_p)
 #endif
 /*
  * Wait until the condition succeeds
@@ -223,27 +403,52 @@ extern struct async_event_loop *async_default_event_loop;
  * Yield execution
  */
 #ifdef ASYNC_DEBUG
-#define async_yield _async_p->_async_k = __LINE__; fprintf(stderr, "<ADEBUG> Yielded in '%s' %s(%d)\n", __func__, __FILE__, __LINE__); return ASYNC_CONT; /* fall through */ case __LINE__: (void)0
+#define async_yield _async_p->_async_k = __LINE__; fprintf(stderr, "<ADEBUG> Yielded in '%s' %s(%d)\n", __func__, __FILE__, __LINE__); return ASYNC_CONT; /* fall through */ case __LINE__: _ASYNC_STEP(_async_p)
 #else
-#define async_yield _async_p->_async_k = __LINE__; return ASYNC_CONT; /* fall through */ case __LINE__: (void)0
+#define async_yield _async_p->_async_k = __LINE__; return ASYNC_CONT; /* fall through */ case __LINE__: _ASYNC_STEP(_async_p)
 #endif
 /*
  * Exit the current async subroutine
  */
 #ifdef ASYNC_DEBUG
-#define async_exit _async_p->_async_k = ASYNC_DONE; ASYNC_DECREF(_async_p); fprintf(stderr, "<ADEBUG> Exited from '%s' %s(%d)\n", __func__, __FILE__, __LINE__); return ASYNC_DONE
+#define async_exit _async_p->_async_k = ASYNC_DONE; _ASYNC_STEP(_async_p); _ASYNC_SELF_DECREF(_async_p); fprintf(stderr, "<ADEBUG> Exited from '%s' %s(%d)\n", __func__, __FILE__, __LINE__); return ASYNC_DONE
 #else
-#define async_exit _async_p->_async_k = ASYNC_DONE; ASYNC_DECREF(_async_p); return ASYNC_DONE
+#define async_exit _async_p->_async_k = ASYNC_DONE; _ASYNC_STEP(_async_p); _ASYNC_SELF_DECREF(_async_p); return ASYNC_DONE
 #endif
+/*
+ * Wait for the next tick of periodic timer created with async_interval and stored in locals.
+ * Exits the coroutine with ASYNC_EINVAL_STATE if the interval's period isn't positive
+ */
+#define await_tick(interval)                                    \
+    await_while(async_interval_wait_(_async_p, &(interval)));   \
+    if ((interval).next < 0) {                                  \
+        async_errno = ASYNC_EINVAL_STATE;                       \
+        async_exit;                                             \
+    } (void) 0
+
+/*
+ * Move async_file_chunks stored in locals to its next chunk, waiting without blocking while its pages are read in.
+ * Previous chunk's memory is released. chunks.data is NULL once there are no more chunks
+ */
+#define await_chunk(chunks) await_while(async_file_chunks_wait_(_async_p, &(chunks)))
+
+#ifndef ASYNC_NO_CANCEL
 /*
  * Cancels running coroutine
  */
-#define async_cancel(coro) ((coro)->_flags |= _ASYNC_FLAG_MUST_CANCEL)
+#define async_cancel(coro) ((coro)->_flags |= _ASYNC_FLAG_MUST_CANCEL, async_wake_(coro))
 
 /*
  * returns 1 if function was cancelled
  */
 #define async_cancelled(coro) (!!((coro)->_flags & _ASYNC_FLAG_MUST_CANCEL))
+#endif
+
+/*
+ * Set monotonic time (see async_monotonic) the coroutine should finish by, 0 removes the deadline.
+ * A miss of the previous deadline is forgotten, so the new one is counted if missed too.
+ */
+#define async_set_deadline(coro, deadline) ((coro)->_deadline = (deadline), (coro)->_flags &= ~_ASYNC_FLAG_LATE)
 
 /*
  * Check if async subroutine is done
@@ -251,12 +456,37 @@ extern struct async_event_loop *async_default_event_loop;
 #define async_done(coro) ((coro)->_async_k==ASYNC_DONE)
 
 
+#if defined(ASYNC2_IMPLEMENTATION) || defined(ASYNC2_C_)
+static struct astate *async_new_state_(AsyncCallback child_f, void *args, size_t stack_size, size_t stack_offset);
+
+#define async_new(call_func, args, T_locals)\
+  async_new_state_((call_func), (args), sizeof(T_locals), _ASYNC_COMPUTE_OFFSET(struct astate, T_locals))
+#else
 /*
  * Create a new coro
  */
 #define async_new(call_func, args, T_locals)\
   async_new_coro_((call_func), (args), sizeof(T_locals), _ASYNC_COMPUTE_OFFSET(struct astate, T_locals))
+#endif
 
+/*
+ * Create n coros of the same function in one contiguous block, args is an array of n args pointers or NULL.
+ * Returns array of states located inside the block, the block is freed once all the states are freed.
+ */
+#define async_new_many(n, call_func, args, T_locals)                                     \
+  async_new_coros_((n), (call_func), (args), sizeof(T_locals),                          \
+                   _ASYNC_COMPUTE_OFFSET(struct astate, T_locals), _ASYNC_COMPUTE_OFFSET(char, T_locals))
+
+#if defined(ASYNC2_IMPLEMENTATION) || defined(ASYNC2_C_)
+/* Library is compiled into this translation unit, skip the indirect call while default loop is selected */
+static struct astate *async_add_task_(struct astate *state);
+
+static struct astate **async_add_tasks_(size_t n, struct astate **states);
+
+#define async_create_task(coro) async_add_task_(coro)
+
+#define async_create_tasks(n, coros) async_add_tasks_(n, coros)
+#else
 /*
  * Create task from coro
  */
@@ -266,6 +496,17 @@ extern struct async_event_loop *async_default_event_loop;
  * Create tasks from array of states
  */
 #define async_create_tasks(n, coros) (async_get_event_loop()->add_tasks(n, coros))
+#endif
+
+/*
+ * Block progress until the event loop can admit n more tasks without exceeding its limits
+ */
+#define await_capacity(n) await_while(async_capacity_wait_(n))
+
+/*
+ * Block progress until n more records fit into the async_log ring, for producers that must not lose records
+ */
+#define await_log_space(n) await(async_log_has_space(n))
 
 /*
  * Get async_error code for current execution state. Can be used to check for errors after fawait()
@@ -276,24 +517,33 @@ extern struct async_event_loop *async_default_event_loop;
  * Create task and wait until the coro succeeds. Resets async_errno and sets it.
  */
 
-#define fawait(coro)                                       \
-        if ((_async_p->_next = async_create_task(coro))) { \
-            ASYNC_INCREF(_async_p->_next);                 \
-            await(async_done(_async_p->_next));            \
-            ASYNC_DECREF(_async_p->_next);                 \
-            async_errno = _async_p->_next->err;            \
-            _async_p->_next = NULL;                        \
-        } else { async_errno = ASYNC_ENOMEM; }             \
+#define fawait(coro)                                                      \
+        if ((_async_p->_next = async_create_task(coro))) {                \
+            ASYNC_INCREF(_async_p->_next);                                \
+            _ASYNC_SET_PARENT(_async_p->_next, _async_p);                 \
+            await(async_done(_async_p->_next));                           \
+            ASYNC_DECREF(_async_p->_next);                                \
+            async_errno = _async_p->_next->err;                           \
+            _async_p->_next = NULL;                                       \
+        } else { async_errno = async_create_error(1); }                   \
         if(async_errno != ASYNC_OK)
 
 /*
  * Initial preparation for adapter functions like async_sleep
  */
+#ifdef ASYNC_NO_CANCEL
+#define ASYNC_PREPARE_NOARGS(async_callback, state, T_locals, cancel_f, err_label) \
+    (state) = async_new(async_callback, NULL, T_locals);                           \
+    if (!(state)) goto err_label;                                                  \
+    (void) 0
+#else
 #define ASYNC_PREPARE_NOARGS(async_callback, state, T_locals, cancel_f, err_label) \
     (state) = async_new(async_callback, NULL, T_locals);                           \
     if (!(state)) goto err_label;                                                  \
     async_set_on_cancel(state, cancel_f)
+#endif
 
+#ifndef ASYNC_NO_ALLOCS
 #define ASYNC_PREPARE(async_callback, state, args_size, T_locals, cancel_f, err_label) \
     ASYNC_PREPARE_NOARGS(async_callback, state, T_locals, cancel_f);                   \
     if (args_size) {                                                                   \
@@ -314,7 +564,9 @@ extern struct async_event_loop *async_default_event_loop;
 #define async_free(ptr) async_free_(_async_p, ptr)
 
 #define async_free_later(ptr) async_free_later_(_async_p, ptr)
+#endif
 
+#ifndef ASYNC_NO_CANCEL
 /*
  * Set function to be executed on function cancellation once. Can be used to free memory and finish some tasks.
  */
@@ -326,6 +578,7 @@ extern struct async_event_loop *async_default_event_loop;
  * before async_cancel() was called on current state.
  */
 #define async_on_cancel(cancel_func) async_set_on_cancel(_async_p, cancel_func)
+#endif
 
 /*
  * Run few variadic tasks in parallel
@@ -344,10 +597,320 @@ struct astate *async_gather(size_t n, struct astate **states);
  */
 struct astate *async_sleep(double delay);
 
+/*
+ * Block for `delay` seconds, allowing the event loop to fire the timer up to `slack` seconds late.
+ * Deadline is aligned to a multiple of `slack`, so timers with the same slack expire together.
+ */
+struct astate *async_sleep_slack(double delay, double slack);
+
+#ifndef ASYNC_NO_CANCEL
 /*
  * Execute function in `timeout` seconds or cancel it if timeout was reached.
  */
 struct astate *async_wait_for(struct astate *child, double timeout);
+#endif
+
+/*
+ * Block until monotonic clock reaches `deadline`, so repeated sleeps don't accumulate scheduling drift
+ */
+struct astate *async_sleep_until(double deadline);
+
+/*
+ * Create periodic timer to be awaited with await_tick, no memory is allocated per period.
+ * Ticks missed under overload are skipped and counted instead of firing in a burst.
+ * Period must be positive, await_tick on an interval with any other period fails with ASYNC_EINVAL_STATE
+ */
+struct async_interval async_interval(double period);
+
+/*
+ * Current value of the monotonic clock in seconds, used by all timers. Virtual clock while async_sim_event_loop is the current loop.
+ * Starts at 1 on the first call, so it is always greater than 0, which timers and deadlines use for "unset"
+ */
+double async_monotonic(void);
+
+/*
+ * Monotonic time cached by the event loop at the start of current cycle, so all tasks
+ * and timers get a consistent time view without reading the clock. Reads the clock when loop isn't running.
+ */
+double async_now(void);
+
+/*
+ * Seed of the async_sim_event_loop scheduling order, takes effect immediately and on every loop->init()
+ */
+void async_sim_seed(unsigned long seed);
+
+/*
+ * Record scheduling decisions of async_sim_event_loop (clock, runnable count and resume order of every cycle)
+ * into binary file at path, NULL stops recording. Returns ASYNC_EINVAL_STATE if already recording.
+ * Only the sim loop records and replays: the other loops take wakeups from the OS clock and I/O readiness,
+ * which a log can't feed back, and don't write to an open recording. Run the workload on the sim loop to capture it
+ */
+async_error async_sim_record(const char *path);
+
+/*
+ * Replay log written by async_sim_record with the same binary in place of the seeded order. Replay ends at
+ * the end of the log or at the first cycle that doesn't match it. NULL stops replaying and returns
+ * ASYNC_EINVAL_STATE if the program diverged from the log, ASYNC_OK otherwise
+ */
+async_error async_sim_replay(const char *path);
+
+/*
+ * Returns 1 if n more tasks can be added to the current event loop without exceeding its limits
+ */
+int async_has_capacity(size_t n);
+
+/*
+ * Reason adding n tasks to the current event loop has just failed: ASYNC_EAGAIN if it's at its limits,
+ * ASYNC_ENOMEM otherwise (coro couldn't be created or there's no memory to add it)
+ */
+async_error async_create_error(size_t n);
+
+/*
+ * Reserve size bytes of address space and allocate states created by async_new from it from now on.
+ * Pages are committed on first use, advised for transparent huge pages where supported and
+ * returned to the OS once fully free. States too big for the arena or created after it is exhausted
+ * fall back to calloc. Returns ASYNC_ENOMEM if the platform has no mmap or the region can't be reserved,
+ * ASYNC_EINVAL_STATE if an arena is already reserved.
+ */
+async_error async_arena_reserve(size_t size);
+
+/*
+ * Return all fully free arena pages to the OS, some are otherwise kept for reuse.
+ * Returns the number of bytes released.
+ */
+size_t async_arena_trim(void);
+
+/*
+ * Unmap the task arena, states created by async_new are calloc'd again from then on and another arena can be
+ * reserved. Returns ASYNC_EINVAL_STATE if no arena is reserved or some of its states are not freed yet.
+ */
+async_error async_arena_release(void);
+
+#ifdef ASYNC_PROFILE
+/*
+ * Sample CPU time of the process every `interval` seconds with SIGPROF. Each sample records the task the event loop
+ * is resuming, the line it was resumed at and the chain of coroutines awaiting it, up to ASYNC_PROFILE_DEPTH frames.
+ * Samples are kept in a fixed buffer of ASYNC_PROFILE_SAMPLES entries, the ones that don't fit are counted as dropped.
+ * Returns ASYNC_ENOMEM if the platform has no SIGPROF interval timer, ASYNC_EINVAL_STATE if sampling already runs.
+ */
+async_error async_profile_start(double interval);
+
+/*
+ * Stop sampling, collected samples are kept until async_profile_dump
+ */
+void async_profile_stop(void);
+
+/*
+ * Write collected samples to f as folded stacks for flame graph tools, one "outer:line;...;inner:line count"
+ * line per distinct stack, and drop them. Line is the one the coroutine was resumed at, 0 before its first suspension.
+ * CPU time outside of tasks is reported as "[event loop]" or "[no event loop]". Returns number of samples written.
+ */
+size_t async_profile_dump(FILE *f);
+
+/*
+ * Record every task finishing from now on with the coroutine awaiting it and the times it was scheduled and finished at
+ */
+void async_critpath_start(void);
+
+/*
+ * Stop recording, records are kept until async_critpath_dump
+ */
+void async_critpath_stop(void);
+
+/*
+ * Compute critical path of every recorded task tree whose top-level task has finished: the chain of segments
+ * the end-to-end latency of the tree consists of, following the child that released each wait of its parent.
+ * Write time every function spent on these paths to f, largest first, and drop all records.
+ * Returns number of task trees analysed.
+ */
+size_t async_critpath_dump(FILE *f);
+#endif
+
+/*
+ * Create or truncate the file at path, map it and publish metrics of whatever event loop runs into it after every cycle.
+ * Returns ASYNC_ENOMEM if the platform has no mmap or the file can't be mapped, ASYNC_EINVAL_STATE if a file is already open.
+ */
+async_error async_metrics_open(const char *path);
+
+/*
+ * Stop publishing and unmap the file, the file itself stays
+ */
+void async_metrics_close(void);
+
+/*
+ * Consistent copy of metrics published by a loop, possibly from another process. Returns ASYNC_EAGAIN if the
+ * loop kept writing during a few attempts in a row, ASYNC_EINVAL_STATE if shared doesn't hold metrics.
+ */
+async_error async_metrics_snapshot(const struct async_metrics *shared, struct async_metrics *copy);
+
+/*
+ * Write-ahead log with group commit: records appended during one loop cycle are written out with one write
+ * and one fdatasync by a writer task the log schedules on demand. Counters may be read by the application.
+ */
+struct async_wal {
+    async_error err; /* first write or sync error, appends fail with it from then on */
+    unsigned long appended; /* records appended so far, sequence number of the last one */
+    unsigned long durable; /* records written and synced to the file */
+    unsigned long batches; /* write + fdatasync rounds done */
+    unsigned long _appenders; /* coroutines returned by async_wal_append and not finished yet */
+    int _fd;
+    void *_flusher; /* thread writing and syncing batches off the loop */
+    async_arr_t(char) _batch; /* records collected for the next round */
+    s_astate _writer; /* task writing batches out, NULL while there's nothing to write */
+};
+
+/*
+ * Open log file at path for appending, creating it if needed, and start the thread writing it out.
+ * Returns NULL on failure or where unsupported
+ */
+struct async_wal *async_wal_open(const char *path);
+
+/*
+ * Copy record into the current batch and return coroutine finishing once it is durable, or with wal->err.
+ * Records are written as given, frame them if the log is read back. Returns NULL if out of memory
+ */
+struct astate *async_wal_append(struct async_wal *wal, const void *data, size_t size);
+
+/*
+ * Close the log and free it. Returns ASYNC_EINVAL_STATE without closing while records are still being written
+ * or coroutines returned by async_wal_append haven't finished yet
+ */
+async_error async_wal_close(struct async_wal *wal);
+
+/*
+ * Reader of a file in chunks mapped into memory, see async_file_chunks. Keep it in locals
+ */
+struct async_file_chunks {
+    const char *data; /* current chunk, NULL before the first await_chunk and once the file is exhausted */
+    size_t size; /* of the current chunk, chunk_size except for the last one */
+    size_t offset; /* of the current chunk in the file */
+    async_error err; /* ASYNC_EIO if the file can't be opened, ASYNC_ENOMEM if it can't be mapped */
+    unsigned long waits; /* polls await_chunk made for pages still being read in */
+    char *_map;
+    size_t _length, _chunk, _next, _advised;
+    unsigned char *_vec; /* mincore residency of the next chunk's pages */
+    unsigned int _polls;
+    int _fd, _waiting;
+};
+
+/*
+ * Open file at path for reading in chunks of chunk_size rounded up to whole pages, check err of the result.
+ * Kernel reads a few chunks ahead of the current one, chunks behind it are released from memory
+ */
+struct async_file_chunks async_file_chunks(const char *path, size_t chunk_size);
+
+/*
+ * Unmap and close the file, the current chunk becomes invalid
+ */
+void async_file_chunks_close(struct async_file_chunks *chunks);
+
+/*
+ * Watch of a file or directory for inotify events, see async_watch_path. Keep it in locals.
+ * Watches are process-global, not per loop: one inotify descriptor and one watch table serve every loop, events
+ * are read by whichever loop is current, and loop->destroy()/init() neither close nor reset them. Close watches
+ * before destroying the loop their watchers wait on
+ */
+struct async_watch {
+    async_error err; /* ASYNC_EIO if the path can't be watched, ASYNC_ENOMEM where inotify isn't available */
+    unsigned int events; /* inotify mask bits of the batch taken by the last async_watch_events */
+    unsigned long count; /* number of events in that batch */
+    int _wd;
+};
+
+/*
+ * Start watching path for inotify events in mask (IN_MODIFY, IN_CLOSE_WRITE, ...), check err of the result.
+ * Watches of the same path share their events and the union of their masks until the last one is closed
+ */
+struct async_watch async_watch_path(const char *path, unsigned int mask);
+
+/*
+ * Coroutine finishing once events arrived for watch since the previous batch was taken, all of them are
+ * taken as one batch into watch->events and watch->count. Waiting costs nothing until something changes.
+ * Fails with ASYNC_EINVAL_STATE if the watch is closed or another coroutine waits for the same path
+ */
+struct astate *async_watch_events(struct async_watch *watch);
+
+/*
+ * Stop watching, events not taken yet are dropped
+ */
+void async_watch_close(struct async_watch *watch);
+
+/*
+ * Start logging into descriptor fd (not closed by the logger). Records wait in a ring of ASYNC_LOG_SLOTS
+ * until a drain task the logger schedules on demand writes them out with one writev per loop cycle.
+ * Returns ASYNC_EINVAL_STATE if the logger is open already, ASYNC_ENOMEM where writev isn't available.
+ * The logger is process-global, not per loop: all loops share the ring, and the drain runs on the loop that was
+ * current when the first record of a batch was logged. Switching loops leaves that batch queued until the drain's
+ * loop runs again; close the logger, which writes the rest out, before destroying its loop
+ */
+async_error async_log_open(int fd);
+
+/*
+ * printf-style record prefixed with async_now() and ended with newline, truncated to ASYNC_LOG_LINE bytes.
+ * Never blocks: returns 0 and counts the record in async_log_dropped if the ring is full or logger isn't open
+ */
+int async_log(const char *fmt, ...);
+
+/*
+ * Returns 1 if n more records fit into the ring right now
+ */
+int async_log_has_space(size_t n);
+
+/*
+ * Number of records dropped because the ring was full, the drain reports drops in the log too
+ */
+unsigned long async_log_dropped(void);
+
+/*
+ * Write out records still in the ring, blocking, and stop logging
+ */
+void async_log_close(void);
+
+/*
+ * Allow tasks of call_func to be checkpointed, registered under the function's name. Locals are saved as raw bytes,
+ * so they must not hold pointers or absolute monotonic times; rebase (may be NULL) moves such times after restore.
+ * Returns ASYNC_EINVAL_STATE if the function or its name is registered already
+ */
+#define async_checkpoint_register(call_func, T_locals, rebase)                                 \
+  async_checkpoint_register_(#call_func, (call_func), sizeof(T_locals),                        \
+                             _ASYNC_COMPUTE_OFFSET(struct astate, T_locals), (rebase))
+
+async_error async_checkpoint_register_(const char *name, AsyncCallback func, size_t stack_size, size_t stack_offset,
+                                       AsyncRebaseCallback rebase);
+
+/*
+ * Snapshot tasks of the current event loop into file at path: registered function, suspension point, timers,
+ * locals and args as index into handles. Tasks that are finished and not awaited are skipped. Returns
+ * ASYNC_EINVAL_STATE and writes nothing if any other task isn't registered, has args missing from handles
+ * or memory from async_alloc, or if the loop is async_soa_event_loop or async_mlfq_event_loop, which keep
+ * their tasks elsewhere. Returns ASYNC_EIO if the file can't be written. Sleeping on async_sleep* children
+ * is supported
+ */
+async_error async_checkpoint_save(const char *path, void **handles, size_t n_handles);
+
+/*
+ * Recreate tasks saved by async_checkpoint_save in the current event loop, with timers moved to the current clock
+ * and args taken from handles by index. Suspension points are line numbers, so the binary must be built from the
+ * same sources of registered functions. Returns ASYNC_EINVAL_STATE and adds nothing if the file doesn't match,
+ * ASYNC_EIO if it can't be opened
+ */
+async_error async_checkpoint_restore(const char *path, void **handles, size_t n_handles);
+
+#ifdef ASYNC_WATCHDOG
+/*
+ * Report states that made no progress (passed no suspension point) for more than `threshold` seconds to f with their
+ * function, line and age. Stuck states are unfinished and wait for neither a timer nor an unfinished child. Leaked states
+ * are finished yet still referenced, or were never scheduled, while no unfinished task awaits them. Function of a state
+ * is known once it's first resumed, "?" is reported before. Returns number of states reported.
+ */
+size_t async_watchdog_sweep(double threshold, FILE *f);
+
+/*
+ * Task running async_watchdog_sweep(threshold, stderr) every `period` seconds.
+ * Exits on its next wakeup once it's the only task left in the event loop.
+ */
+struct astate *async_watchdog(double period, double threshold);
+#endif
 
 struct async_event_loop *async_get_event_loop(void);
 
@@ -358,16 +921,33 @@ void async_set_event_loop(struct async_event_loop *);
  */
 struct astate *async_new_coro_(AsyncCallback child_f, void *args, size_t stack_size, size_t stack_offset);
 
+struct astate **async_new_coros_(size_t n, AsyncCallback child_f, void **args,
+                                 size_t stack_size, size_t stack_offset, size_t stack_align);
+
 void async_free_coro_(struct astate *state);
 
 void async_free_coros_(size_t n, struct astate **states);
 
+#ifndef ASYNC_NO_ALLOCS
 void *async_alloc_(struct astate *state, size_t size);
 
 int async_free_(struct astate *state, void *mem);
 
 int async_free_later_(struct astate *state, void *mem);
+#endif
+
+int async_capacity_wait_(size_t n);
+
+void async_wake_(struct astate *state);
+
+int async_interval_wait_(struct astate *state, struct async_interval *interval);
+
+int async_file_chunks_wait_(struct astate *state, struct async_file_chunks *chunks);
 
 const char *async_strerror(async_error err);
 
+#if defined(ASYNC2_IMPLEMENTATION) && !defined(ASYNC2_C_)
+    #include "async2.c"
+#endif
+
 #endif
@@ -0,0 +1,365 @@
+#include "async2.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(__linux__)
+    #include <string.h>
+    #include <unistd.h>
+    #include <sys/syscall.h>
+    #include <linux/perf_event.h>
+    #define BENCH_LINUX
+#endif
+
+#define bench_section(desc)       \
+    {                             \
+        printf("--- %s\n", desc); \
+    }                             \
+    (void) 0
+
+#define bench_report(what, n, elapsed)                                             \
+    printf("%-28s %9lu tasks %10.3f ms %8.1f ns/task\n", what, (unsigned long) (n), \
+           (elapsed) * 1e3, (elapsed) * 1e9 / (double) ((n) ? (n) : 1))
+
+/* Resident set size in bytes, 0 where unknown */
+static size_t bench_rss(void) {
+    size_t rss = 0;
+#ifdef BENCH_LINUX
+    unsigned long size, resident;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f != NULL) {
+        if (fscanf(f, "%lu %lu", &size, &resident) == 2) {
+            rss = resident * (size_t) sysconf(_SC_PAGESIZE);
+        }
+        fclose(f);
+    }
+#endif
+    return rss;
+}
+
+/* Opens data TLB miss counter of this process, returns -1 where unavailable */
+static int bench_tlb_open(void) {
+#ifdef BENCH_LINUX
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+static double bench_tlb_read(int fd) {
+#ifdef BENCH_LINUX
+    unsigned long long count;
+    if (fd >= 0 && read(fd, &count, sizeof(count)) == sizeof(count)) {
+        return (double) count;
+    }
+#endif
+    (void) fd;
+    return -1;
+}
+
+static async parked(s_astate state) {
+    async_begin(state);
+    fawait(async_sleep(1000)) {
+    }
+    async_end;
+}
+
+static async chained(s_astate state) {
+    async_begin(state);
+    fawait((struct astate *) state->args) {
+    }
+    async_end;
+}
+
+static async ticks(s_astate state) {
+    int *n = state->args;
+    async_begin(state);
+    while (--*n > 0) {
+        async_yield;
+    }
+    async_end;
+}
+
+/* Loop cycles of the steady state phase, long enough that spawning and first resumes don't count */
+#define BENCH_STEADY_CYCLES 256
+
+/*
+ * Spawn n parents each awaiting a sleeping child, run a few loop cycles and tear the loop down.
+ * With depth > 0 tasks form chains of depth awaiting parents instead, each scheduled after the task it awaits.
+ * The steady phase then runs BENCH_STEADY_CYCLES cycles over the now parked tasks, reported per task per cycle,
+ * which measures the cost of skipping a task that has nothing to do.
+ */
+static void bench_loop(struct async_event_loop *loop, size_t n, size_t depth) {
+    double start;
+    size_t i, j;
+    struct astate *child;
+    int n_ticks = 4;
+
+    async_set_event_loop(loop);
+    loop = async_get_event_loop();
+    loop->init();
+
+    start = async_monotonic();
+    for (i = 0; i < n; i++) {
+        if (depth == 0) {
+            async_create_task(async_new(parked, NULL, ASYNC_NONE));
+            continue;
+        }
+        child = async_create_task(async_sleep(1000));
+        for (j = 1; j < depth && i + 1 < n; j++, i++) {
+            child = async_create_task(async_new(chained, child, ASYNC_NONE));
+        }
+    }
+    bench_report("spawn", n, async_monotonic() - start);
+
+    start = async_monotonic();
+    loop->run_until_complete(async_new(ticks, &n_ticks, ASYNC_NONE));
+    bench_report("run 4 cycles", loop->n_tasks, async_monotonic() - start);
+
+    n_ticks = BENCH_STEADY_CYCLES;
+    start = async_monotonic();
+    loop->run_until_complete(async_new(ticks, &n_ticks, ASYNC_NONE));
+    bench_report("steady cycle", loop->n_tasks * BENCH_STEADY_CYCLES, async_monotonic() - start);
+
+    n = loop->n_tasks;
+    start = async_monotonic();
+    loop->destroy();
+    bench_report("destroy", n, async_monotonic() - start);
+
+    async_set_event_loop(async_default_event_loop);
+}
+
+typedef struct {
+    int step;
+} request_stack;
+
+/* Request doing three slices of CPU work, args counts the ones finished by their deadline */
+static async request(s_astate state) {
+    request_stack *stack = state->locals;
+    unsigned long *met = state->args;
+    double start;
+    async_begin(state);
+    for (stack->step = 0; stack->step < 3; stack->step++) {
+        start = async_monotonic();
+        while (async_monotonic() - start < 20e-6) {}
+        async_yield;
+    }
+    if (async_monotonic() <= state->_deadline) {
+        (*met)++;
+    }
+    async_end;
+}
+
+/* Overloaded request path: n requests with 60us of work each and deadlines 2..32ms away */
+static void bench_deadlines(struct async_event_loop *loop, size_t n, int shed_late) {
+    struct astate *state;
+    unsigned long met = 0;
+    double now;
+    size_t i;
+
+    async_set_event_loop(loop);
+    loop = async_get_event_loop();
+    loop->init();
+    loop->shed_late = shed_late;
+    srand(1);
+    now = async_monotonic();
+    for (i = 0; i < n; i++) {
+        state = async_create_task(async_new(request, &met, request_stack));
+        if (state) async_set_deadline(state, now + 0.002 + 0.03 * (rand() % 1000) / 1000.0);
+    }
+    loop->run_forever();
+    printf("%-28s %9lu tasks %10lu met %9.1f %%\n", shed_late ? "deadlines met, shedding" : "deadlines met",
+           (unsigned long) n, met, 100.0 * (double) met / (double) (n ? n : 1));
+    loop->shed_late = 0;
+    loop->destroy();
+    async_set_event_loop(async_default_event_loop);
+}
+
+typedef struct {
+    struct async_wal *wal;
+    int records; /* appended by each task */
+    size_t running; /* appenders not finished yet */
+    double stall; /* longest gap between resumes of a task sharing the loop with them */
+} appender_args;
+
+typedef struct {
+    int i;
+} appender_stack;
+
+/* Appends records one after another, each waiting until the previous one is durable */
+static async appender(s_astate state) {
+    appender_stack *stack = state->locals;
+    appender_args *args = state->args;
+    async_begin(state);
+    for (stack->i = 0; stack->i < args->records; stack->i++) {
+        fawait(async_wal_append(args->wal, "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcde\n", 64)) {
+            break;
+        }
+    }
+    args->running--;
+    async_end;
+}
+
+typedef struct {
+    double last;
+} bystander_stack;
+
+/* Unrelated task yielding until the appenders are done, a sync blocking the loop shows up as a long gap */
+static async bystander(s_astate state) {
+    bystander_stack *stack = state->locals;
+    appender_args *args = state->args;
+    double now;
+    async_begin(state);
+    stack->last = async_monotonic();
+    while (args->running > 0) {
+        async_yield;
+        now = async_monotonic();
+        if (now - stack->last > args->stall) args->stall = now - stack->last;
+        stack->last = now;
+    }
+    async_end;
+}
+
+/* n durable 64 byte appends made by tasks appending concurrently, group commit turns them into fewer syncs */
+static void bench_wal(size_t n, size_t tasks) {
+    struct async_event_loop *loop = async_get_event_loop();
+    const char *path = "async2_bench.wal";
+    appender_args args;
+    double start;
+    size_t i;
+
+    remove(path);
+    args.wal = async_wal_open(path);
+    args.records = (int) (n / tasks);
+    args.running = tasks;
+    args.stall = 0;
+    if (args.wal == NULL) {
+        printf("write-ahead log is not available\n");
+        return;
+    }
+    loop->init();
+    start = async_monotonic();
+    for (i = 0; i < tasks; i++) {
+        async_create_task(async_new(appender, &args, appender_stack));
+    }
+    async_create_task(async_new(bystander, &args, bystander_stack));
+    loop->run_forever();
+    start = async_monotonic() - start;
+    printf("%-28s %9lu recs %10.3f ms %8lu batches %9.0f recs/s\n", tasks > 1 ? "group commit" : "sync per record",
+           args.wal->durable, start * 1e3, args.wal->batches, (double) args.wal->durable / start);
+    printf("%-28s %22.3f ms\n", "longest stall of other task", args.stall * 1e3);
+    loop->destroy();
+    async_wal_close(args.wal);
+    remove(path);
+}
+
+/* Cost of the async_create_task call itself, measured on a task that is already scheduled */
+static void bench_calls(size_t n) {
+    struct async_event_loop *loop = async_get_event_loop();
+    struct astate *volatile task; /* reloaded every iteration, so the call isn't hoisted out of the loop */
+    double start;
+    size_t i;
+
+    loop->init();
+    task = async_create_task(async_sleep(0));
+    start = async_monotonic();
+    for (i = 0; i < n; i++) {
+        async_create_task(task);
+    }
+    bench_report("async_create_task call", n, async_monotonic() - start);
+    loop->destroy();
+}
+
+/* Memory footprint of n parked parents with their children, run through a few loop cycles */
+static void bench_scale(size_t n) {
+    struct async_event_loop *loop = async_get_event_loop();
+    size_t i;
+    int n_ticks = 4, fd;
+    double misses, rss;
+
+    loop->init();
+    rss = (double) bench_rss();
+    for (i = 0; i < n; i++) {
+        async_create_task(async_new(parked, NULL, ASYNC_NONE));
+    }
+    fd = bench_tlb_open();
+    misses = bench_tlb_read(fd);
+    loop->run_until_complete(async_new(ticks, &n_ticks, ASYNC_NONE));
+    if (misses >= 0) {
+        misses = bench_tlb_read(fd) - misses;
+        printf("%-28s %9lu tasks %10.0f misses %8.2f per task\n", "dTLB load misses, 4 cycles",
+               (unsigned long) loop->n_tasks, misses, misses / (double) (loop->n_tasks ? loop->n_tasks : 1));
+    } else {
+        printf("%-28s n/a\n", "dTLB load misses, 4 cycles");
+    }
+#ifdef BENCH_LINUX
+    if (fd >= 0) close(fd);
+#endif
+    rss = (double) bench_rss() - rss;
+    printf("%-28s %9lu tasks %10.1f MiB %8.1f B/task\n", "RSS growth", (unsigned long) loop->n_tasks,
+           rss / (1024 * 1024), rss / (double) (loop->n_tasks ? loop->n_tasks : 1));
+    rss = (double) bench_rss();
+    loop->destroy();
+    async_arena_trim();
+    printf("%-28s %22.1f MiB\n", "RSS released by destroy", (rss - (double) bench_rss()) / (1024 * 1024));
+}
+
+int main(int argc, char **argv) {
+    size_t n = 100000;
+    if (argc > 1) {
+        n = (size_t) strtoul(argv[1], NULL, 10);
+    }
+    printf("sizeof(struct astate) = %lu, %s\n", (unsigned long) sizeof(struct astate),
+#ifdef ASYNC2_IMPLEMENTATION
+           "library compiled in, direct calls to the default loop"
+#else
+           "library linked separately, calls through the event loop"
+#endif
+    );
+
+    bench_section("request deadlines, default event loop");
+    bench_deadlines(async_default_event_loop, 400, 0);
+
+    bench_section("request deadlines, earliest deadline first event loop");
+    bench_deadlines(async_edf_event_loop, 400, 0);
+    bench_deadlines(async_edf_event_loop, 400, 1);
+
+    bench_section("write-ahead log, 1 and 64 appending tasks");
+    bench_wal(512, 1);
+    bench_wal(512 * 16, 64);
+
+    bench_section("call overhead");
+    bench_calls(n * 100);
+
+    bench_section("scale, calloc'd states");
+    bench_scale(n);
+
+    bench_section("scale, task arena");
+    if (async_arena_reserve(n * 2 * 512) == ASYNC_OK) {
+        bench_scale(n);
+        async_arena_release(); /* the sections below measure calloc'd states */
+    } else {
+        printf("arena is not available\n");
+    }
+
+    bench_section("default event loop");
+    bench_loop(async_default_event_loop, n, 0);
+
+    bench_section("default event loop, chains of 16 awaiting tasks");
+    bench_loop(async_default_event_loop, n, 16);
+
+    bench_section("structure-of-arrays event loop");
+    bench_loop(async_soa_event_loop, n, 0);
+
+    bench_section("structure-of-arrays event loop, chains of 16 awaiting tasks");
+    bench_loop(async_soa_event_loop, n, 16);
+
+    return EXIT_SUCCESS;
+}
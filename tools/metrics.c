@@ -0,0 +1,88 @@
+/*
+ * Reader of metrics published by async_metrics_open, decodes the file without disturbing the loop.
+ * Usage: async2_metrics <file> [interval seconds]
+ * Prints the metrics once, or every interval until interrupted.
+ */
+#include "async2.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #define METRICS_POSIX
+#endif
+
+static void metrics_print(const struct async_metrics *m) {
+    unsigned int i;
+    unsigned long below = 0;
+    printf("updated at %.3f s, %lu cycles, %lu resumes, %.0f resumes/s\n", m->updated, m->cycles, m->resumes,
+           m->resumes_per_sec);
+    printf("tasks live %lu, runnable %lu, states live %lu, arena %.1f MiB\n", m->tasks_live, m->tasks_runnable,
+           m->states_live, (double) m->arena_bytes / (1024 * 1024));
+    printf("idle timer wakeups %lu, rejected tasks %lu, deadline misses %lu\n", m->idle_wakeups, m->rejected_tasks,
+           m->deadline_misses);
+    printf("timers armed %lu, timer expiries %lu\n", m->timers_armed, m->timer_expiries);
+    printf("cycle latency:\n");
+    for (i = 0; i < ASYNC_METRICS_BUCKETS; i++) {
+        if (m->cycle_us[i] == 0) continue;
+        below += m->cycle_us[i];
+        if (i + 1 < ASYNC_METRICS_BUCKETS) {
+            printf("  < %8lu us %12lu %6.2f %%\n", 1UL << i, m->cycle_us[i],
+                   100.0 * (double) below / (double) (m->cycles ? m->cycles : 1));
+        } else {
+            printf("  >= %7lu us %12lu %6.2f %%\n", 1UL << (i - 1), m->cycle_us[i],
+                   100.0 * (double) below / (double) (m->cycles ? m->cycles : 1));
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+#ifdef METRICS_POSIX
+    const struct async_metrics *shared;
+    struct async_metrics m;
+    double interval = 0;
+    async_error err;
+    int fd;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <file> [interval seconds]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (argc > 2) {
+        interval = strtod(argv[2], NULL);
+    }
+    fd = open(argv[1], O_RDONLY);
+    if (fd < 0) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+    shared = mmap(NULL, sizeof(*shared), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shared == MAP_FAILED) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+    do {
+        err = async_metrics_snapshot(shared, &m);
+        if (err == ASYNC_OK) {
+            metrics_print(&m);
+        } else {
+            fprintf(stderr, "%s: %s\n", argv[1],
+                    err == ASYNC_EAGAIN ? "loop is writing too often, try again" : "no metrics published yet");
+        }
+        if (interval > 0) {
+            printf("\n");
+            fflush(stdout);
+            usleep((useconds_t) (interval * 1e6));
+        }
+    } while (interval > 0);
+    munmap((void *) shared, sizeof(*shared));
+    return err == ASYNC_OK ? EXIT_SUCCESS : EXIT_FAILURE;
+#else
+    (void) argc;
+    fprintf(stderr, "%s: shared memory metrics need mmap\n", argv[0]);
+    return EXIT_FAILURE;
+#endif
+}